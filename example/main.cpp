@@ -104,9 +104,9 @@ int main() {
     std::cout << reset << "Index: " << red << end_time_ms << " ms" << std::endl;
     start_time = high_resolution_clock::now();
 
-    auto n_results = document.search(number_query, search_options_number);
-    auto t_results = document.search(text_query, search_options_text);
-    auto k_results = document.search(keyword_query, search_options_keyword);
+    auto n_results = document.search(number_query, search_options_number).found;
+    auto t_results = document.search(text_query, search_options_text).found;
+    auto k_results = document.search(keyword_query, search_options_keyword).found;
 
     std::cout << reset << "Search: " << red << end_time_ms << " ms" << std::endl;
 
@@ -125,17 +125,17 @@ int main() {
     }*/
 
     /*for (auto &result : n_results) {
-        auto &field = result.first->find_field(field_name_number);
-        std::cout << reset << field._number->value << green << " (score: " << result.second << ")" << std::endl;
+        auto &field = result.e.find_field(field_name_number);
+        std::cout << reset << field._number->value << green << " (score: " << result.score << ")" << std::endl;
     }*/
     for (auto &result : t_results) {
-        auto &field_id = result.first->find_field(field_name_number);
-        auto &field = result.first->find_field(field_name_text);
-        std::cout << magenta << field_id._number->value << reset << " - " << reset << field._text->value << green << " (score: " << result.second << ")" << std::endl;
+        auto &field_id = result.e.find_field(field_name_number);
+        auto &field = result.e.find_field(field_name_text);
+        std::cout << magenta << field_id._number->value << reset << " - " << reset << field._text->value << green << " (score: " << result.score << ")" << std::endl;
     }
     /*for (auto &result : k_results) {
-        auto &field = result.first.find_field(field_name_keyword);
-        std::cout << reset << field._keyword->value << green << " (score: " << result.second << ")" << std::endl;
+        auto &field = result.e.find_field(field_name_keyword);
+        std::cout << reset << field._keyword->value << green << " (score: " << result.score << ")" << std::endl;
     }*/
 
     start_time = high_resolution_clock::now();
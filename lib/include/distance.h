@@ -0,0 +1,125 @@
+#ifndef DISTANCE_H
+#define DISTANCE_H
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+namespace kissearch {
+    //restricted damerau levenshtein (optimal string alignment), greater distances are returned as max_distance + 1
+    //hyyro bit-parallel for a pattern up to 64 chars, rows otherwise
+    uint32_t compute_damerau_levenshtein_distance(const std::string &s, const std::string &v, const uint32_t &max_distance);
+
+    //bit-parallel column of the distance matrix: vertical deltas of every pattern prefix
+    struct osa_column {
+        uint64_t vp = ~0ULL;
+        uint64_t vn = 0;
+        uint64_t d0 = 0;
+        uint64_t pm = 0;
+        uint32_t score = 0; //distance to the whole pattern
+
+        //pm: pattern positions of the next char, last_bit: 1 << (pattern size - 1)
+        inline void step(const uint64_t &next_pm, const uint64_t &last_bit) {
+            const uint64_t tr = (((~d0) & next_pm) << 1) & pm;
+
+            d0 = (((next_pm & vp) + vp) ^ vp) | next_pm | vn | tr;
+
+            uint64_t hp = vn | ~(d0 | vp);
+            uint64_t hn = vp & d0;
+
+            if (hp & last_bit) ++score;
+            else if (hn & last_bit) --score;
+
+            hp = (hp << 1) | 1;
+            hn = hn << 1;
+
+            vp = hn | ~(d0 | hp);
+            vn = hp & d0;
+            pm = next_pm;
+        }
+        //distance to the pattern prefix of the size, column: text prefix of the size
+        inline int32_t value(const uint32_t &pattern_size, const uint32_t &column) const {
+            const uint64_t mask = pattern_size >= 64 ? ~0ULL : ((1ULL << pattern_size) - 1);
+            return (int32_t) column + __builtin_popcountll(vp & mask) - __builtin_popcountll(vn & mask);
+        }
+    };
+
+    //the distance of a pattern fed one char at a time
+    class damerau_levenshtein_automaton {
+    private:
+        std::string pattern;
+        uint32_t max_distance;
+        bool is_bit_parallel;
+
+        uint64_t masks[256];
+        uint64_t last_bit;
+        std::vector<osa_column> columns; //columns[d]: prefix of length d
+
+        std::vector<std::vector<uint32_t>> rows; //without bit-parallel
+        std::string prefix;
+    private:
+        //prefix + c, false: no extension of the prefix can match
+        bool step(const char &c);
+
+        inline static bool successor(std::string &s) {
+            while (!s.empty()) {
+                if ((unsigned char) s.back() != 0xFF) {
+                    ++s.back();
+                    return true;
+                }
+
+                s.pop_back();
+            }
+
+            return false;
+        }
+    public:
+        damerau_levenshtein_automaton(const std::string &pattern, const uint32_t &max_distance);
+
+        inline uint32_t distance() const {
+            return is_bit_parallel ? columns[prefix.size()].score : rows[prefix.size()].back();
+        }
+
+        //calls on_match(it, distance) for every key of the sorted map within max_distance
+        //the state of a shared prefix is reused, a dead prefix skips all of its keys
+        template<typename map_t, typename callback_t>
+        void walk(const map_t &terms, callback_t on_match) {
+            auto it = terms.begin();
+
+            while (it != terms.end()) {
+                const std::string_view term(it->first);
+                size_t size = 0;
+
+                while (size < prefix.size() && size < term.size() && prefix[size] == term[size]) {
+                    ++size;
+                }
+
+                prefix.resize(size);
+                bool is_dead = false;
+
+                for (; size < term.size(); ++size) {
+                    if (!step(term[size])) {
+                        is_dead = true;
+                        break;
+                    }
+                }
+
+                if (!is_dead) {
+                    if (distance() <= max_distance) on_match(it, distance());
+                    ++it;
+                    continue;
+                }
+
+                std::string next(term.substr(0, size + 1));
+                if (!successor(next)) break;
+
+                it = terms.lower_bound(next);
+            }
+        }
+    };
+}
+
+#endif
@@ -4,27 +4,56 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <cstdint>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
 #include <cmath>
 #include <algorithm>
 #include <filesystem>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <memory>
+#include <optional>
 #include <libstemmer.h>
 
 #include "entry.h"
+#include "posting.h"
+#include "distance.h"
+#include "query.h"
+#include "intersection.h"
+#include "stop_words.h"
+#include "stem_cache.h"
+#include "term_index.h"
 
 namespace kissearch {
     class document {
     public:
         typedef std::pair<std::string, std::string> field_t;
-        typedef std::pair<entry *, double> result_t;
+        //dense id of an entry: its position in entries
+        typedef uint32_t entry_id_t;
+        //a hit, e: its entry copied under the lock (adds and compactions move the entries), id: at the time of the search
+        struct result_t {
+            entry_id_t id;
+            double score;
+            entry e;
+        };
 
         struct search_options {
             std::vector<std::string> field_names;
             bool sort_by_score = true;
+            //ranked text pages count the scored entries only, true: every hit is counted
+            bool track_total_hits = false;
             ulong page = 1;
             ulong page_size = 10;
+            //next_cursor of the previous page: page_size hits after it in the ranked order, page is ignored
+            std::string search_after;
+            //bm25 of the query, negative: the k and b of the document
+            double k = -1;
+            double b = -1;
 
             struct {
                 enum match_type {
@@ -37,58 +66,326 @@ namespace kissearch {
                 match_type _match_type = match_type::fuzzy;
             } text;
         };
-        struct entry_info {
-            double score = 0;
-            ulong count = 0;
+        struct search_result {
+            std::vector<result_t> found; //the page, every hit with is_all
+            ulong total_hits = 0;
+            bool is_total_hits_exact = true; //false: total_hits is a lower bound
+            std::string next_cursor; //search_after of the next page, empty: no more hits
+        };
+        typedef term_index term_index_t; //fuzzy terms are found with an automaton over its sorted view
+        //postings of the entries [base, base + size) by text field, immutable once flushed
+        struct segment {
+            entry_id_t base = 0;
+            entry_id_t size = 0;
+            std::unordered_map<std::string, term_index_t> term_indexes;
+
+            inline const term_index_t *find(const std::string &field_name) const {
+                auto found = term_indexes.find(field_name);
+                return found == term_indexes.end() ? nullptr : &found->second;
+            }
         };
-        struct term_info {
-            std::unordered_map<entry *, entry_info> entries;
-            double idf = 0;
+        //a matched term of a field: its postings in the segments
+        struct term_postings {
+            std::string term;
+            std::vector<const posting_list *> postings;
+            ulong df = 0; //entries with the term
+            ulong weight = 0; //matched query terms
+            size_t first_query = 0; //the query term that matched it first
+        };
+        //what a query term matches: postings of the text fields, ids of the other fields
+        struct term_match {
+            std::vector<std::pair<const posting_list *, posting_iterator::scorer_t>> postings;
+            std::vector<std::vector<entry_id_t>> filters;
+            bool is_stop_only = true;
+
+            inline ulong cost() const {
+                ulong cost = 0;
+
+                for (auto &p : postings) {
+                    cost += p.first->size();
+                }
+                for (auto &f : filters) {
+                    cost += f.size();
+                }
+
+                return cost;
+            }
+        };
+        //dense scores by id, clear resets the touched ids only
+        struct accumulator {
+            std::vector<double> scores;
+            std::vector<entry_id_t> ids; //touched, in hit order
+
+            inline void resize(const size_t &size) {
+                if (scores.size() < size) scores.resize(size, 0);
+            }
+            inline void add(const entry_id_t &id, const double &score) {
+                auto &s = scores[id];
+                if (s == 0) ids.push_back(id);
+                s += score;
+            }
+            //once per id, the score can be 0
+            inline void set(const entry_id_t &id, const double &score) {
+                ids.push_back(id);
+                scores[id] = score;
+            }
+            inline void clear() {
+                for (auto &id : ids) {
+                    scores[id] = 0;
+                }
+
+                ids.clear();
+            }
+        };
+        //the stats of a text field over the segments
+        struct field_index {
+            std::vector<uint8_t> norms; //by id: posting_list::encode_length of the field terms, 0 without the field
+            ulong terms_length = 0; //sum of the decoded norms: a removed entry takes back what it added
+            ulong entries_count = 0; //entries with the field
+            bool has_positions = false; //postings with the term positions: phrase and NEAR queries
+
+            inline double avgdl() const { return entries_count == 0 ? 0 : (double) terms_length / (double) entries_count; }
+            inline uint32_t length(const entry_id_t &id) const { return posting_list::decode_length(norms[id]); }
+            //norms must have the id
+            inline void add_length(const entry_id_t &id, const size_t &length) {
+                norms[id] = posting_list::encode_length((uint32_t) std::min(length, (size_t) std::numeric_limits<uint32_t>::max()));
+                terms_length += this->length(id);
+                ++entries_count;
+            }
+            inline void remove_length(const entry_id_t &id) {
+                terms_length -= length(id);
+                --entries_count;
+            }
+            inline void clear() {
+                norms.clear();
+                terms_length = 0;
+                entries_count = 0;
+            }
+        };
+
+        //removed ids until the compaction, a bit per id
+        struct live_docs {
+            std::vector<uint64_t> removed;
+            entry_id_t removed_count = 0;
+
+            inline bool is_live(const entry_id_t &id) const {
+                return (id >> 6) >= removed.size() || (removed[id >> 6] >> (id & 63) & 1) == 0;
+            }
+            //false: already removed
+            inline bool remove(const entry_id_t &id) {
+                if (!is_live(id)) return false;
+                if ((id >> 6) >= removed.size()) removed.resize((id >> 6) + 1, 0);
+
+                removed[id >> 6] |= 1ULL << (id & 63);
+                ++removed_count;
+
+                return true;
+            }
+            inline void clear() {
+                removed.clear();
+                removed_count = 0;
+            }
         };
 
         std::string name;
         std::vector<entry> entries;
         std::vector<field_t> fields;
-        std::unordered_map<std::string, term_info> term_index;
+        //number or keyword field of a unique key: remove_by_key and upsert, an added entry replaces the one of its key, empty: none
+        std::string primary_key;
+        //one inverted index per text field (schema text fields + index_text_field calls)
+        std::unordered_map<std::string, field_index> indexes;
+
+        //entries of a flushed buffer
+        static constexpr entry_id_t buffer_size = 4096;
+        //tiered merge: this many adjacent segments of a size tier become one segment of the next tier
+        static constexpr size_t merge_factor = 8;
+        //a remove compacts once 1 / compaction_ratio of the entries are removed
+        static constexpr entry_id_t compaction_ratio = 4;
     private:
         double k;
         double b;
-        std::mutex mutex;
-        struct sb_stemmer *stemmer;
+        ulong threads_count;
+        std::string language; //libstemmer algorithm
+        stop_words stops;
+        //stems of the language by surface form, for every thread, replaced with the language: an add analyzing outside of the lock keeps its own
+        std::shared_ptr<stem_cache> stems_cache;
+        //searches share it, changes and the swap of merged segments own it
+        std::shared_mutex mutex;
+
+        std::vector<std::shared_ptr<const segment>> segments; //by base
+        std::shared_ptr<segment> buffer; //the added entries since the last flush, after the segments
+        std::condition_variable_any merge_condition;
+        std::thread merge_thread;
+        bool is_stopped = false;
+
+        live_docs live;
+        //primary key value -> id, live entries only
+        std::unordered_map<std::string, entry_id_t> keys;
+        ulong next_key_number = 1; //of a number primary key: over every key ever added
     public:
         inline static std::string get_file_content(const std::string &file_name);
 
-        inline static bool is_stop(const std::string &s);
+        //reused buffers of an analysis: no allocation per token once grown
+        struct analysis {
+            std::string text; //the lowercased text, the tokens point into it
+            std::vector<std::string_view> tokens;
+            std::string stems; //the stemmed terms back to back
+            std::vector<uint32_t> stem_ends;
+            std::vector<std::pair<std::string_view, uint32_t>> terms; //(stemmed term, position), into stems
+        };
+        //the postings of an entry field, analyzed before the lock: one run per distinct term, in term order
+        struct analyzed_field {
+            bool has_field = false;
+            std::string terms; //back to back
+            std::vector<uint32_t> term_ends;
+            std::vector<uint32_t> counts; //term frequency by term
+            std::vector<uint32_t> positions; //counts[i] positions by term, empty without positions
+            size_t length = 0; //terms of the field
+        };
+        //the text fields to index in name order: (field name, has positions)
+        typedef std::vector<std::pair<std::string, bool>> text_fields_t;
 
-        inline static void normalize(std::string &s);
-        inline static std::vector<std::string> tokenize(const std::string &text);
-        inline void stem(std::vector<std::string> &terms);
+        //words of text lowercased into scratch, split on any byte other than an ascii letter or digit, ' or a byte of utf-8
+        //the tokens are valid until the next call with scratch
+        inline static void tokenize(const std::string &text, std::string &scratch, std::vector<std::string_view> &tokens);
     private:
         inline static void write_block(std::stringstream &content, const std::string &type, const std::string &value);
         inline static void write_block(std::stringstream &content, const std::string &key, const std::string &type, const std::string &value);
         inline static void parse_block(const std::string &s, std::string &key, std::string &type, std::string &value);
     private:
-        inline ulong compute_document_length_in_words(const std::string &field_name);
-        inline double compute_tf(entry &e, const std::string &term);
-        inline void compute_idf(const ulong &entries_size);
-        inline double compute_bm25(entry &e, const std::string &term, const double &idf, const ulong &terms_length, const double &avgdl);
-        int compute_damerau_levenshtein_distance(std::string s, std::string v);
+        inline static double compute_idf(const ulong &entries_count, const ulong &entries_size);
+        inline static double compute_bm25(const ulong &tf, const double &idf, const ulong &terms_length, const double &avgdl, const double &k, const double &b);
+        inline void bm25_parameters(const search_options &options, double &k, double &b) const;
+
+        //the stemmer of the calling thread for the language, nullptr when unknown
+        //the libstemmer environment is not reentrant: searches and index workers stem in parallel with their own
+        static struct sb_stemmer *thread_stemmer(const std::string &language);
+        //analysis.terms: (term, position) in text order, a stop word is skipped but keeps its position
+        inline static void analyze(stem_cache &cache, struct sb_stemmer *stemmer, const stop_words &stops, const std::string &text, analysis &analysis);
+        //the analyzed terms of a query, copied: a query has a few
+        inline std::vector<std::pair<std::string, uint32_t>> analyze_query(const std::string &text);
+        inline std::vector<std::string> query_terms(const std::string &text);
+
+        //the stemmer and the stop words of the language, throws std::invalid_argument when unknown
+        void set_language(const std::string &language);
+
+        //true: an index of a text field of the schema was created, the entries before it are not in it
+        inline bool update_indexes();
+        //the schema text fields and the indexed ones, without changing indexes: a shared lock is enough
+        inline text_fields_t text_fields() const;
+        //the postings of the entry field into analyzed, false without the field
+        inline static bool analyze_field(entry &e, const std::string &field_name, const bool &has_positions, stem_cache &cache, struct sb_stemmer *stemmer, const stop_words &stops, analyzed_field &analyzed);
+        //analyzed[i][f]: text_fields[f] of es[i]
+        static void analyze_entries(std::vector<entry> &es, const text_fields_t &text_fields, const std::string &language, stem_cache &cache, const stop_words &stops, std::vector<std::vector<analyzed_field>> &analyzed);
+        //ids grow with the entries: push_back keeps the postings sorted
+        inline static void add_postings(const analyzed_field &analyzed, const entry_id_t &id, term_index_t &term_index);
+        //the analyzed fields of id into the buffer, a full buffer is flushed
+        inline void index_entry(const entry_id_t &id, const text_fields_t &text_fields, const std::vector<analyzed_field> &analyzed);
+        //the segments are rebuilt from the entries, one per worker with threads_count > 1
+        void reindex();
+        void flush_buffer();
+
+        template<typename callback_t>
+        inline void for_each_segment(callback_t callback) const {
+            for (auto &s : segments) {
+                callback(*s);
+            }
+
+            callback(*buffer);
+        }
+        //[from, to) of the segments to merge, false: nothing to merge
+        inline bool find_merge(size_t &from, size_t &to) const;
+        //adjacent segments into one, norms: the norms of their entries by field, from the first base
+        static std::shared_ptr<segment> merge(const std::vector<std::shared_ptr<const segment>> &merged, const std::unordered_map<std::string, std::vector<uint8_t>> &norms);
+        //the background merge thread
+        void merge_segments();
+
+        //false: already removed, its postings and field stats stay until the compaction: the idf of a term never drops below 0
+        inline bool remove_id(const entry_id_t &id);
+        //the removed entries are dropped and the ids of the others shifted, the segments are rebuilt
+        void compact_removed();
+        inline void compact_if_removed();
+
+        //the primary key value of e, false without the field
+        inline bool find_key(const entry &e, std::string &key) const;
+        //the entry of id owns its key, the previous entry of the key is removed
+        inline void index_key(const entry_id_t &id);
+        inline void reindex_keys();
+        //analyzed under no lock, the exclusive lock only appends them to the buffer: searches wait for the append only
+        void add_entries(std::vector<entry> es);
     public:
-        explicit document(const double &k = 1.2, const double &b = 0.75);
+        //threads_count > 1: index() and index_text_field() build the index on a worker pool
+        //language: a libstemmer algorithm (sb_stemmer_list), its stemmer and stop words, throws std::invalid_argument when unknown
+        explicit document(const double &k = 1.2, const double &b = 0.75, const ulong &threads_count = 1, const std::string &language = "english");
         ~document();
 
-        //ID
+        inline const std::string &get_language() const { return language; }
+
+        //ID, of the primary key: never reused after a remove
         ulong compute_next_number_value(const std::string &field_name);
 
         void index();
-        void index_text_field(const std::string &field_name);
+        //has_positions: phrase and NEAR queries on the field, an indexed field keeps its positions
+        void index_text_field(const std::string &field_name, const bool &has_positions = false);
+        //the added entries become an immutable segment, add() flushes every buffer_size entries
+        void flush();
+        //the flushed segments, valid after later merges
+        std::vector<std::shared_ptr<const segment>> get_segments();
+        //entries without the removed ones
+        ulong get_entries_count();
+        //false: removed, its entry stays in entries until the compaction
+        inline bool is_live(const entry_id_t &id) const { return live.is_live(id); }
+
+    private:
+        //[from, to) of the page in size results
+        inline static void page_bounds(const search_options &options, const size_t &size, size_t &from, size_t &to);
+        //(score, id) of a hit, ids move on compaction: a cursor is valid until the next one
+        inline static std::string encode_cursor(const double &score, const entry_id_t &id);
+        inline static void decode_cursor(const std::string &cursor, double &score, entry_id_t &id);
 
-        inline static void slice_page(std::vector<result_t> &results, const search_options &options);
+        inline std::string field_type(const std::string &field_name);
+        //false: value is not a number, it matches no number field
+        inline static bool parse_number(const std::string &value, ulong &number);
+        //matched terms of the field over the segments, ordered by the first query term and the term
+        inline std::vector<term_postings> find_terms(const std::string &field_name, const std::vector<std::string> &terms, const search_options &options) const;
+        //block-max wand over the text fields
+        search_result search_top_k(const std::vector<std::string> &terms, const search_options &options);
+        inline posting_iterator::scorer_t bm25_scorer(const field_index &index, const ulong &df, const double &weight, const search_options &options) const;
+        inline term_match match_term(const query_node &node, const search_options &options);
+        //phrase or proximity node: positional over the fields with positions, a conjunction of its words over the others
+        //throws std::invalid_argument when a side of NEAR is not exactly one term
+        query_iterator_ptr compile_positional(const query_node &node, const search_options &options);
+        inline static query_iterator_ptr compile(term_match &match);
+        //sorted ids of a term match, only among candidates when not nullptr
+        inline static std::vector<entry_id_t> match_ids(const term_match &match, const std::vector<entry_id_t> *candidates);
+        //iterators of a boolean query, nullptr: only stop words
+        query_iterator_ptr compile(const query_node &node, const search_options &options);
+        //page of the accumulated hits, without their entries
+        search_result collect(accumulator &hits, const search_options &options, const bool &is_all);
+        //the caller holds the lock, the hits come without their entries
+        search_result search_locked(const std::string &query, const search_options &options, const bool &is_all);
+    public:
 
-        std::vector<result_t> search(const std::string &query, const search_options &options, const bool is_all = false);
+        //throws std::invalid_argument on page or page_size 0 without is_all
+        search_result search(const std::string &query, const search_options &options, const bool is_all = false);
 
+        //every entry equal to e
         void remove(const entry &e);
+        //ids of entries: valid until the next change of the document
+        void remove(const std::vector<entry_id_t> &ids);
+        //every hit of the query, searched and removed under one lock, returns the count
+        ulong remove(const std::string &query, const search_options &options);
+        //the removed entries are dropped: ids move, search_after cursors are invalidated
+        void compact();
+        //false: no entry with the key
+        bool remove_by_key(const std::string &key);
+        //replaces the entry of its primary key or adds it, only its postings change, throws std::invalid_argument without the key
+        void upsert(const entry &e);
+        //a copy of the entry, empty: no entry with the key
+        std::optional<entry> find_by_key(const std::string &key);
         void add(const entry &e);
+        void add(const std::vector<entry> &es);
+        void clear();
 
         void load(const std::string &file_name);
         void save(const std::string &file_name);
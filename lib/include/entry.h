@@ -27,7 +27,6 @@ namespace kissearch {
 
         struct text {
             std::string value;
-            ulong terms_length;
 
             text();
             explicit text(const std::string &text);
@@ -92,6 +91,10 @@ namespace kissearch {
             const auto lambda = [&](const field &f) { return f.name == name; };
             return std::find_if(fields.begin(), fields.end(), lambda)->val;
         }
+        inline bool has_field(const std::string &name) const {
+            const auto lambda = [&](const field &f) { return f.name == name; };
+            return std::find_if(fields.begin(), fields.end(), lambda) != fields.end();
+        }
 
         inline bool operator==(const entry &e) const { return this->fields == e.fields; }
     };
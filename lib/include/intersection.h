@@ -0,0 +1,46 @@
+#ifndef INTERSECTION_H
+#define INTERSECTION_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+namespace kissearch {
+    //kernels of sorted unique ids, out needs simd_padding ids after the result: simd stores whole registers
+    constexpr size_t simd_padding = 8;
+    //a list this many times longer is galloped instead of merged
+    constexpr size_t galloping_ratio = 64;
+
+    //the cpu runs the kernels of the name, call them directly only when true
+    bool has_sse42();
+    bool has_avx2();
+
+    //out: min(a_size, b_size) + simd_padding, returns the size
+    size_t intersect_scalar(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out);
+    size_t intersect_galloping(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out);
+    size_t intersect_sse42(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out);
+    size_t intersect_avx2(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out);
+    //galloping for skewed sizes, otherwise the best kernel of the cpu
+    size_t intersect(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out);
+
+    //out: a_size + b_size + simd_padding, returns the size
+    size_t unite_scalar(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out);
+    size_t unite_sse42(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out);
+    size_t unite(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out);
+
+    inline std::vector<uint32_t> intersect(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+        std::vector<uint32_t> out(std::min(a.size(), b.size()) + simd_padding);
+        out.resize(intersect(a.data(), a.size(), b.data(), b.size(), out.data()));
+
+        return out;
+    }
+    inline std::vector<uint32_t> unite(const std::vector<uint32_t> &a, const std::vector<uint32_t> &b) {
+        std::vector<uint32_t> out(a.size() + b.size() + simd_padding);
+        out.resize(unite(a.data(), a.size(), b.data(), b.size(), out.data()));
+
+        return out;
+    }
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef POSTING_H
+#define POSTING_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+
+namespace kissearch {
+    //sorted (id, count) postings: full blocks of block_size are delta + bit-packed, the rest is kept in tail
+    //lengths are kept by the field norms, the blocks only bound them
+    //optional positions: count delta varints per posting, in id order
+    class posting_list {
+    public:
+        typedef uint32_t entry_id_t;
+
+        static constexpr uint32_t block_size = 128;
+        static constexpr entry_id_t end_id = std::numeric_limits<entry_id_t>::max();
+
+        struct posting {
+            entry_id_t id = 0;
+            uint32_t count = 0;
+        };
+        //skip data, max_count + min_length (decoded) bound the score of the block
+        struct block {
+            entry_id_t last_id;
+            uint32_t offset; //in data
+            uint32_t positions_offset; //in positions
+            uint32_t max_count;
+            uint32_t min_length;
+        };
+        struct block_max {
+            entry_id_t last_id;
+            uint32_t max_count;
+            uint32_t min_length;
+        };
+
+        class iterator {
+        private:
+            const posting_list *list;
+            size_t block_index; //blocks.size(): tail
+
+            entry_id_t ids[block_size];
+            uint32_t counts[block_size];
+            uint32_t size;
+            uint32_t index;
+
+            //positions of the posting positions_index start at positions_cursor
+            uint32_t positions_index;
+            size_t positions_cursor;
+        private:
+            inline void load_block();
+        public:
+            explicit iterator(const posting_list *list);
+
+            inline entry_id_t id() const { return index < size ? ids[index] : end_id; }
+            inline uint32_t count() const { return counts[index]; }
+            inline bool is_end() const { return index >= size; }
+
+            void next();
+            //first posting with id >= target
+            void advance(const entry_id_t &target);
+            //skip data of the block with target, nothing is decoded
+            block_max shallow_advance(const entry_id_t &target) const;
+            //sorted positions of the current posting, empty without positions
+            void positions(std::vector<uint32_t> &out);
+        };
+    private:
+        std::vector<block> blocks;
+        std::vector<uint8_t> data;
+        std::vector<posting> tail;
+        uint32_t tail_max_count = 0;
+        uint32_t tail_min_length = std::numeric_limits<uint32_t>::max();
+
+        std::vector<uint8_t> positions;
+        uint32_t tail_positions_offset = 0;
+
+        uint32_t size_ = 0;
+        uint32_t max_count_ = 0;
+        uint32_t min_length_ = std::numeric_limits<uint32_t>::max();
+    private:
+        inline static void pack(const uint32_t *values, const uint32_t &size, const uint8_t &bits, std::vector<uint8_t> &out);
+        inline static const uint8_t *unpack(const uint8_t *in, const uint32_t &size, const uint8_t &bits, uint32_t *values);
+        inline static uint8_t bits_size(const uint32_t *values, const uint32_t &size);
+        inline static void write_varint(uint32_t value, std::vector<uint8_t> &out);
+        inline static uint32_t read_varint(const uint8_t *&in);
+
+        void encode_block(const posting *postings, const uint32_t &size);
+        void seal_tail();
+        //counts: nullptr for the ids only
+        uint32_t decode_block(const size_t &block_index, entry_id_t *ids, uint32_t *counts) const;
+    public:
+        //a field length in one byte (norm), 4 bits of mantissa: exact up to 31, then within 1/16 below, monotonic
+        inline static uint8_t encode_length(const uint32_t &length) {
+            if (length < 32) return (uint8_t) length;
+
+            const auto shift = (uint32_t) (27 - __builtin_clz(length)); //length >> shift: [16, 31]
+            if (shift > 14) return 255;
+
+            return (uint8_t) (16 * (shift + 1) + ((length >> shift) - 16));
+        }
+        inline static uint32_t decode_length(const uint8_t &length) {
+            if (length < 32) return length;
+            return (16 + (uint32_t) (length & 15)) << ((length >> 4) - 1);
+        }
+
+        inline uint32_t size() const { return size_; }
+        inline uint32_t max_count() const { return max_count_; }
+        inline uint32_t min_length() const { return min_length_; }
+        inline bool empty() const { return size_ == 0; }
+        inline bool has_positions() const { return !positions.empty(); }
+        inline iterator begin() const { return iterator(this); }
+
+        //heap bytes + the object
+        size_t memory_size() const;
+
+        //id must be greater than the last id, length: terms of the entry field
+        //positions: count sorted positions, all or none of the postings of a list have them
+        void push_back(const entry_id_t &id, const uint32_t &count, const uint32_t &length, const uint32_t *positions = nullptr);
+        void clear();
+        //packs the tail into a short last block, push_back unpacks it again
+        void seal();
+
+        std::vector<posting> decode() const;
+        std::vector<entry_id_t> ids() const;
+        //sorted ids of the list among the sorted ids, only the blocks with some of the ids are decoded
+        std::vector<entry_id_t> intersect(const std::vector<entry_id_t> &ids) const;
+    };
+}
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <stdexcept>
+
+#include "posting.h"
+
+namespace kissearch {
+    //boolean query: NOT > NEAR/k > AND > OR, implicit operator: OR, field:term, field:(...), "phrase"
+    struct query_node {
+        enum node_type {
+            term,
+            conjunction,
+            disjunction,
+            negation,
+            phrase, //value: the words
+            proximity, //two terms within distance positions
+        };
+
+        node_type type = term;
+        std::string field_name; //term, phrase, proximity: empty for the searched fields
+        std::string value; //term, phrase
+        uint32_t distance = 0; //proximity
+        std::vector<query_node> children;
+    };
+
+    //is_field: the prefix of field:term, otherwise the colon is a char of the word (urls)
+    typedef std::function<bool(const std::string &)> is_field_t;
+
+    //a query that does not parse: search() runs it as a plain query
+    class query_syntax_error : public std::invalid_argument {
+    public:
+        using std::invalid_argument::invalid_argument;
+    };
+
+    //AND, OR, NOT, NEAR/k, "phrase" or field:term, a plain query is a disjunction of its words
+    //false when it does not lex (a lone "), throws std::invalid_argument on a NEAR distance over 2^32 - 1
+    bool is_boolean_query(const std::string &query, const is_field_t &is_field);
+    //throws query_syntax_error on a syntax error, std::invalid_argument on a NEAR distance over 2^32 - 1
+    query_node parse_query(const std::string &query, const is_field_t &is_field);
+
+    //sorted ids of the matching entries, id() is end_id when exhausted
+    class query_iterator {
+    public:
+        typedef posting_list::entry_id_t entry_id_t;
+
+        virtual ~query_iterator() = default;
+
+        virtual entry_id_t id() const = 0;
+        virtual void next() = 0;
+        //first id >= target
+        virtual void advance(const entry_id_t &target) = 0;
+        //ids upper bound, conjunctions start with the cheapest
+        virtual ulong cost() const = 0;
+        //sum of the matching terms scores at id()
+        virtual double score() const = 0;
+    };
+    typedef std::unique_ptr<query_iterator> query_iterator_ptr;
+
+    class posting_iterator : public query_iterator {
+    public:
+        //(id, count) -> score
+        typedef std::function<double(const entry_id_t &, const uint32_t &)> scorer_t;
+    private:
+        posting_list::iterator it;
+        ulong size;
+        scorer_t scorer;
+    public:
+        posting_iterator(const posting_list &postings, scorer_t scorer);
+
+        inline entry_id_t id() const override { return it.id(); }
+        inline void next() override { it.next(); }
+        inline void advance(const entry_id_t &target) override { it.advance(target); }
+        inline ulong cost() const override { return size; }
+        inline double score() const override { return scorer(it.id(), it.count()); }
+
+        inline void positions(std::vector<uint32_t> &out) { it.positions(out); }
+    };
+
+    //sorted ids with a constant score: the filters of the number, keyword and boolean fields
+    class ids_iterator : public query_iterator {
+    private:
+        std::vector<entry_id_t> ids;
+        size_t index = 0;
+        double constant_score;
+    public:
+        explicit ids_iterator(std::vector<entry_id_t> ids, const double &constant_score = 1);
+
+        inline entry_id_t id() const override { return index < ids.size() ? ids[index] : posting_list::end_id; }
+        inline void next() override { ++index; }
+        void advance(const entry_id_t &target) override;
+        inline ulong cost() const override { return ids.size(); }
+        inline double score() const override { return constant_score; }
+    };
+
+    //every id of [0, size), scored 0: the base of a negation
+    class all_iterator : public query_iterator {
+    private:
+        entry_id_t current = 0;
+        entry_id_t size;
+    public:
+        explicit all_iterator(const entry_id_t &size);
+
+        inline entry_id_t id() const override { return current < size ? current : posting_list::end_id; }
+        inline void next() override { ++current; }
+        inline void advance(const entry_id_t &target) override { current = std::max(current, target); }
+        inline ulong cost() const override { return size; }
+        inline double score() const override { return 0; }
+    };
+
+    //ids of every child and none of excluded, leapfrog from the cheapest child
+    class conjunction_iterator : public query_iterator {
+    private:
+        std::vector<query_iterator_ptr> children;
+        std::vector<query_iterator_ptr> excluded;
+    private:
+        void align();
+    public:
+        conjunction_iterator(std::vector<query_iterator_ptr> children, std::vector<query_iterator_ptr> excluded);
+
+        inline entry_id_t id() const override { return children.front()->id(); }
+        void next() override;
+        void advance(const entry_id_t &target) override;
+        inline ulong cost() const override { return children.front()->cost(); }
+        double score() const override;
+    };
+
+    //ids with the terms at their offsets (phrase) or two terms within distance (near), postings with positions
+    class positional_iterator : public query_iterator {
+    public:
+        enum match_type {
+            phrase,
+            near,
+        };
+    private:
+        std::vector<std::unique_ptr<posting_iterator>> terms;
+        std::vector<uint32_t> offsets; //phrase: of the first term
+        match_type type;
+        uint32_t distance;
+        entry_id_t current;
+
+        std::vector<std::vector<uint32_t>> positions;
+    private:
+        bool is_match();
+        void find();
+    public:
+        positional_iterator(std::vector<std::unique_ptr<posting_iterator>> terms, std::vector<uint32_t> offsets, const match_type &type, const uint32_t &distance);
+
+        inline entry_id_t id() const override { return current; }
+        void next() override;
+        void advance(const entry_id_t &target) override;
+        ulong cost() const override;
+        double score() const override;
+    };
+
+    //ids of any child
+    class disjunction_iterator : public query_iterator {
+    private:
+        std::vector<query_iterator_ptr> children;
+        entry_id_t current;
+    private:
+        void update();
+    public:
+        explicit disjunction_iterator(std::vector<query_iterator_ptr> children);
+
+        inline entry_id_t id() const override { return current; }
+        void next() override;
+        void advance(const entry_id_t &target) override;
+        ulong cost() const override;
+        double score() const override;
+    };
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef STEM_CACHE_H
+#define STEM_CACHE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+#include <libstemmer.h>
+
+namespace kissearch {
+    //surface form -> stem of one language, shared by the indexing and searching threads
+    //a shard per hash under its own mutex, a full shard is cleared: the working set of the text comes back quickly
+    class stem_cache {
+    public:
+        static constexpr size_t shards_count = 16;
+        static constexpr uint32_t shard_slots = 4096; //a power of 2
+        static constexpr uint32_t shard_capacity = shard_slots / 2; //linear probing stays short
+        //longer tokens are rare, stemmed without the cache
+        static constexpr size_t max_token_size = 64;
+    private:
+        struct slot {
+            uint32_t hash = 0;
+            uint32_t offset = 0; //into bytes: the surface form then its stem
+            uint8_t surface_size = 0; //0: free
+            uint8_t stem_size = 0;
+        };
+
+        struct shard {
+            std::mutex mutex;
+            std::vector<slot> slots; //allocated by the first insert
+            std::string bytes;
+            uint32_t count = 0;
+        };
+
+        std::array<shard, shards_count> shards;
+    private:
+        //the slot of surface or the free slot where it goes
+        inline static slot &find(shard &s, const std::string_view &surface, const uint32_t &hash);
+    public:
+        //appends the stem of token to out, a miss is stemmed by stemmer (of the calling thread) outside of the lock
+        void stem(const std::string_view &token, struct sb_stemmer *stemmer, std::string &out);
+        void clear();
+
+        //the cached surface forms
+        size_t size();
+    };
+}
+
+#endif
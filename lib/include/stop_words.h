@@ -0,0 +1,127 @@
+#ifndef STOP_WORDS_H
+#define STOP_WORDS_H
+
+#include <string>
+#include <string_view>
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <stdexcept>
+
+namespace kissearch {
+    //seed 0 picks the bucket of a word, the seed of its bucket picks its slot
+    constexpr uint32_t stop_words_hash(const std::string_view &s, const uint32_t &seed) {
+        uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+
+        for (auto c : s) {
+            h = (h ^ (unsigned char) c) * 16777619u;
+        }
+
+        h ^= h >> 16;
+        h *= 0x85ebca6bu;
+        h ^= h >> 13;
+
+        return h;
+    }
+
+    //the stop words of a language: two hashes and one compare per lookup
+    struct stop_words {
+        const std::string_view *slots = nullptr;
+        const uint32_t *seeds = nullptr;
+        uint32_t mask = 0; //slots size - 1
+        uint32_t buckets_size = 0; //0: no stop words
+
+        constexpr bool contains(const std::string_view &s) const {
+            if (buckets_size == 0) return false;
+
+            const auto seed = seeds[stop_words_hash(s, 0) % buckets_size];
+            return slots[stop_words_hash(s, seed) & mask] == s;
+        }
+    };
+
+    //perfect hash table built at compile time (hash and displace): words are split into buckets of about 4,
+    //the largest buckets first, a bucket takes the first seed that puts all of its words into free slots
+    template<size_t size>
+    struct stop_words_table {
+        static constexpr size_t slots_size = []() {
+            size_t s = 1;
+            while (s < size * 2) s *= 2;
+            return s;
+        }();
+        static constexpr size_t buckets_size = size / 4 + 1;
+
+        std::array<std::string_view, slots_size> slots {};
+        std::array<uint32_t, buckets_size> seeds {};
+
+        //the words must be unique: a duplicate never gets a seed
+        constexpr explicit stop_words_table(const std::string_view (&words)[size]) {
+            std::array<uint32_t, size> buckets {};
+            std::array<uint32_t, buckets_size> bucket_sizes {};
+            std::array<uint32_t, buckets_size> order {};
+
+            for (size_t i = 0; i < size; ++i) {
+                buckets[i] = stop_words_hash(words[i], 0) % buckets_size;
+                ++bucket_sizes[buckets[i]];
+            }
+
+            //largest first: they are the hardest to place
+            for (size_t i = 0; i < buckets_size; ++i) {
+                size_t j = i;
+
+                for (; j > 0 && bucket_sizes[order[j - 1]] < bucket_sizes[i]; --j) {
+                    order[j] = order[j - 1];
+                }
+
+                order[j] = (uint32_t) i;
+            }
+
+            std::array<bool, slots_size> is_used {};
+            std::array<uint32_t, size> taken {};
+
+            for (auto bucket : order) {
+                if (bucket_sizes[bucket] == 0) break;
+
+                for (uint32_t seed = 1;; ++seed) {
+                    if (seed == 1u << 20) throw std::logic_error("stop_words_table: a duplicated word");
+
+                    size_t count = 0;
+                    bool is_free = true;
+
+                    for (size_t i = 0; i < size && is_free; ++i) {
+                        if (buckets[i] != bucket) continue;
+
+                        const auto slot = stop_words_hash(words[i], seed) & (slots_size - 1);
+                        is_free = !is_used[slot];
+
+                        for (size_t j = 0; j < count && is_free; ++j) {
+                            is_free = taken[j] != slot;
+                        }
+
+                        taken[count++] = slot;
+                    }
+
+                    if (!is_free) continue;
+
+                    for (size_t i = 0, j = 0; i < size; ++i) {
+                        if (buckets[i] != bucket) continue;
+
+                        is_used[taken[j]] = true;
+                        slots[taken[j++]] = words[i];
+                    }
+
+                    seeds[bucket] = seed;
+                    break;
+                }
+            }
+        }
+
+        constexpr stop_words view() const {
+            return { slots.data(), seeds.data(), (uint32_t) slots_size - 1, (uint32_t) buckets_size };
+        }
+    };
+
+    //a libstemmer algorithm name or alias, no stop words for a language without a list
+    const stop_words &find_stop_words(const std::string &language);
+}
+
+#endif
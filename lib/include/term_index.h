@@ -0,0 +1,121 @@
+#ifndef TERM_INDEX_H
+#define TERM_INDEX_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <atomic>
+#include <mutex>
+
+#include "posting.h"
+
+namespace kissearch {
+    struct term_info {
+        posting_list postings;
+    };
+
+    //the terms of a field in a segment interned into one arena, a term id is the index of its term and of its postings
+    //lookup: a flat open addressing table of ids over the arena, no allocation per term
+    class term_index {
+    public:
+        typedef uint32_t term_id_t;
+        static constexpr term_id_t npos = std::numeric_limits<term_id_t>::max();
+
+        //first: the term, in the arena until the next intern
+        template<typename info_t>
+        struct basic_value {
+            std::string_view first;
+            info_t &second;
+        };
+
+        //ids in id order (ids nullptr) or in the order of ids
+        template<typename index_t, typename info_t>
+        class basic_iterator {
+        private:
+            index_t *index;
+            const term_id_t *ids;
+            size_t i;
+
+            struct arrow {
+                basic_value<info_t> value;
+                inline const basic_value<info_t> *operator->() const { return &value; }
+            };
+        public:
+            basic_iterator(index_t *index, const term_id_t *ids, const size_t &i) : index(index), ids(ids), i(i) {}
+
+            inline term_id_t id() const { return ids == nullptr ? (term_id_t) i : ids[i]; }
+            inline basic_value<info_t> operator*() const { return { index->term(id()), index->info(id()) }; }
+            inline arrow operator->() const { return { **this }; }
+
+            inline basic_iterator &operator++() { ++i; return *this; }
+            inline bool operator==(const basic_iterator &other) const { return i == other.i; }
+            inline bool operator!=(const basic_iterator &other) const { return i != other.i; }
+        };
+        typedef basic_iterator<term_index, term_info> iterator;
+        typedef basic_iterator<const term_index, const term_info> const_iterator;
+
+        //the terms in term order for the fuzzy automaton
+        class sorted_terms {
+        private:
+            const term_index *index;
+            const std::vector<term_id_t> *ids;
+        public:
+            explicit sorted_terms(const term_index &index) : index(&index), ids(&index.sorted) {}
+
+            inline const_iterator begin() const { return const_iterator(index, ids->data(), 0); }
+            inline const_iterator end() const { return const_iterator(index, ids->data(), ids->size()); }
+            //first term >= term
+            const_iterator lower_bound(const std::string_view &term) const;
+        };
+    private:
+        std::string arena; //the terms back to back
+        std::vector<uint32_t> ends; //by id: the end of its term in arena
+        std::vector<term_info> infos; //by id
+        std::vector<term_id_t> slots; //id + 1, 0: free, a power of 2 at most half full
+        //ids by term: the ids interned since the last sort are merged by the next sorted_view() or seal()
+        mutable std::vector<term_id_t> sorted;
+        mutable std::atomic<bool> is_sorted { true };
+        mutable std::mutex sort_mutex; //the searches of the shared lock sort the buffer once
+    private:
+        inline static size_t hash(const std::string_view &term);
+        void grow();
+        //merges the new ids into the sorted ids
+        void sort_terms() const;
+    public:
+        inline size_t size() const { return ends.size(); }
+        inline bool empty() const { return ends.empty(); }
+
+        inline std::string_view term(const term_id_t &id) const {
+            const auto start = id == 0 ? 0 : ends[id - 1];
+            return { arena.data() + start, ends[id] - start };
+        }
+        inline term_info &info(const term_id_t &id) { return infos[id]; }
+        inline const term_info &info(const term_id_t &id) const { return infos[id]; }
+
+        //the id of the term, a new term gets the next id
+        term_id_t intern(const std::string_view &value);
+        //npos when missing
+        term_id_t find_id(const std::string_view &value) const;
+        inline const term_info *find(const std::string_view &value) const {
+            const auto id = find_id(value);
+            return id == npos ? nullptr : &infos[id];
+        }
+
+        inline iterator begin() { return iterator(this, nullptr, 0); }
+        inline iterator end() { return iterator(this, nullptr, size()); }
+        inline const_iterator begin() const { return const_iterator(this, nullptr, 0); }
+        inline const_iterator end() const { return const_iterator(this, nullptr, size()); }
+        //sorts the ids interned since the last view: by the first fuzzy query after the adds, not by every add
+        sorted_terms sorted_view() const;
+
+        //the postings are sealed, the terms sorted and the arena shrunk
+        void seal();
+        //heap bytes + the object, a posting list by its object size only
+        size_t memory_size() const;
+    };
+}
+
+#endif
@@ -0,0 +1,156 @@
+#include "../include/distance.h"
+
+namespace kissearch {
+    //rows, stops when a row is over max_distance
+    inline uint32_t compute_damerau_levenshtein_distance_rows(const std::string &s, const std::string &v, const uint32_t &max_distance) {
+        const auto v_size = v.size();
+        std::vector<uint32_t> row_2(v_size + 1), row_1(v_size + 1), row(v_size + 1);
+
+        for (uint32_t j = 0; j <= v_size; ++j) {
+            row_1[j] = j;
+        }
+
+        for (size_t i = 1; i <= s.size(); ++i) {
+            row[0] = (uint32_t) i;
+            uint32_t min = row[0];
+
+            for (size_t j = 1; j <= v_size; ++j) {
+                const uint32_t cost = s[i - 1] == v[j - 1] ? 0 : 1;
+                row[j] = std::min(std::min(row_1[j] + 1, row[j - 1] + 1), row_1[j - 1] + cost);
+
+                if (i > 1 && j > 1 && s[i - 1] == v[j - 2] && s[i - 2] == v[j - 1]) {
+                    row[j] = std::min(row[j], row_2[j - 2] + cost);
+                }
+
+                min = std::min(min, row[j]);
+            }
+
+            if (min > max_distance) return max_distance + 1;
+
+            std::swap(row_2, row_1);
+            std::swap(row_1, row);
+        }
+
+        return std::min(row_1[v_size], max_distance + 1);
+    }
+
+    uint32_t compute_damerau_levenshtein_distance(const std::string &s, const std::string &v, const uint32_t &max_distance) {
+        const auto &pattern = s.size() <= v.size() ? s : v;
+        const auto &text = s.size() <= v.size() ? v : s;
+
+        const auto pattern_size = (uint32_t) pattern.size();
+        const auto text_size = (uint32_t) text.size();
+
+        if (text_size - pattern_size > max_distance) return max_distance + 1;
+        if (pattern_size == 0) return text_size;
+        if (pattern_size > 64) return compute_damerau_levenshtein_distance_rows(s, v, max_distance);
+
+        uint64_t masks[256];
+        std::memset(masks, 0, sizeof(masks));
+
+        for (uint32_t i = 0; i < pattern_size; ++i) {
+            masks[(unsigned char) pattern[i]] |= 1ULL << i;
+        }
+
+        const uint64_t last_bit = 1ULL << (pattern_size - 1);
+        osa_column column;
+        column.score = pattern_size;
+
+        for (uint32_t j = 1; j <= text_size; ++j) {
+            column.step(masks[(unsigned char) text[j - 1]], last_bit);
+
+            //every remaining char lowers the score by 1 at most
+            if (column.score > max_distance + (text_size - j)) return max_distance + 1;
+
+            //cells off the diagonal band are over max_distance anyway
+            const auto from = j > max_distance ? j - max_distance : 0;
+            const auto to = std::min(pattern_size, j + max_distance);
+            bool is_alive = false;
+
+            for (auto i = from; i <= to && !is_alive; ++i) {
+                is_alive = column.value(i, j) <= (int32_t) max_distance;
+            }
+
+            if (!is_alive) return max_distance + 1;
+        }
+
+        return std::min(column.score, max_distance + 1);
+    }
+
+    damerau_levenshtein_automaton::damerau_levenshtein_automaton(const std::string &pattern, const uint32_t &max_distance) {
+        this->pattern = pattern;
+        this->max_distance = max_distance;
+        this->is_bit_parallel = !pattern.empty() && pattern.size() <= 64;
+
+        if (is_bit_parallel) {
+            std::memset(masks, 0, sizeof(masks));
+
+            for (size_t i = 0; i < pattern.size(); ++i) {
+                masks[(unsigned char) pattern[i]] |= 1ULL << i;
+            }
+
+            last_bit = 1ULL << (pattern.size() - 1);
+            columns.emplace_back();
+            columns[0].score = (uint32_t) pattern.size();
+        } else {
+            rows.emplace_back(pattern.size() + 1);
+
+            for (uint32_t j = 0; j <= pattern.size(); ++j) {
+                rows[0][j] = j;
+            }
+        }
+    }
+
+    bool damerau_levenshtein_automaton::step(const char &c) {
+        const auto depth = (uint32_t) prefix.size() + 1;
+        const auto pattern_size = (uint32_t) pattern.size();
+
+        if (is_bit_parallel) {
+            if (columns.size() <= depth) {
+                columns.emplace_back();
+            }
+
+            auto &column = columns[depth];
+            column = columns[depth - 1];
+            column.step(masks[(unsigned char) c], last_bit);
+
+            prefix.push_back(c);
+
+            //cells off the diagonal band are over max_distance anyway
+            const auto from = depth > max_distance ? depth - max_distance : 0;
+            const auto to = std::min(pattern_size, depth + max_distance);
+
+            for (auto i = from; i <= to; ++i) {
+                if (column.value(i, depth) <= (int32_t) max_distance) return true;
+            }
+
+            return false;
+        }
+
+        if (rows.size() <= depth) {
+            rows.emplace_back(pattern_size + 1);
+        }
+
+        const auto &previous = rows[depth - 1];
+        auto &current = rows[depth];
+
+        current[0] = depth;
+        uint32_t min = current[0];
+
+        for (size_t j = 1; j <= pattern_size; ++j) {
+            const uint32_t cost = pattern[j - 1] == c ? 0 : 1;
+            current[j] = std::min(std::min(previous[j] + 1, current[j - 1] + 1), previous[j - 1] + cost);
+
+            if (depth > 1 && j > 1 && c == pattern[j - 2] && prefix.back() == pattern[j - 1]) {
+                current[j] = std::min(current[j], rows[depth - 2][j - 2] + cost);
+            }
+
+            min = std::min(min, current[j]);
+        }
+
+        prefix.push_back(c);
+
+        //a row never drops below its min later (transpositions included)
+        return min <= max_distance;
+    }
+}
@@ -1,5 +1,10 @@
+#include <array>
 #include <fstream>
 #include <iterator>
+#include <cstring>
+#include <cstdio>
+#include <charconv>
+#include <stdexcept>
 
 #include "../include/document.h"
 
@@ -19,52 +24,38 @@ namespace kissearch {
         return buffer;
     }
 
-    inline bool document::is_stop(const std::string &s) {
-        const static std::string words[] = {
-                "i", "me", "my", "myself", "we", "our", "ours", "ourselves", "you", "your", "yours", "yourself", "yourselves", "he", "him", "his", "himself", "she", "her", "hers", "herself", "it",
-                "its", "itself", "they", "them", "their", "theirs", "themselves", "what", "which", "who", "whom", "this", "that", "these", "those", "am", "is", "are", "was", "were", "be", "been",
-                "being", "have", "has", "had", "having", "do", "does", "did", "doing", "would", "should", "could", "ought", "i'm", "you're", "he's", "she's", "it's", "we're", "they're", "i've",
-                "you've", "we've", "they've", "i'd", "you'd", "he'd", "she'd", "we'd", "they'd", "i'll", "you'll", "he'll", "she'll", "we'll", "they'll", "isn't", "aren't", "wasn't", "weren't",
-                "hasn't", "haven't", "hadn't", "doesn't", "don't", "didn't", "won't", "wouldn't", "shan't", "shouldn't", "can't", "cannot", "couldn't", "mustn't", "let's", "that's", "who's", "what's",
-                "here's", "there's", "when's", "where's", "why's", "how's", "a", "an", "the", "and", "but", "if", "or", "because", "as", "until", "while", "of", "at", "by", "for", "with", "about",
-                "against", "between", "into", "through", "during", "before", "after", "above", "below", "to", "from", "up", "down", "in", "out", "on", "off", "over", "under", "again", "further",
-                "then", "once", "here", "there", "when", "where", "why", "how", "all", "any", "both", "each", "few", "more", "most", "other", "some", "such", "no", "nor", "not", "only", "own", "same",
-                "so", "than", "too", "very",
-        };
-        const static auto words_size = 174;
-
-        for (short i = 0; i < words_size; ++i) {
-            auto &w = words[i];
+    inline void document::tokenize(const std::string &text, std::string &scratch, std::vector<std::string_view> &tokens) {
+        //byte -> its lowercase, 0: a separator
+        static constexpr auto word_bytes = []() {
+            std::array<char, 256> bytes {};
 
-            if (s.front() == w.front() && s == w) {
-                return true;
+            for (int c = 0; c < 256; ++c) {
+                if (c >= 'A' && c <= 'Z') bytes[c] = (char) (c - 'A' + 'a');
+                else if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '\'' || c >= 0x80) bytes[c] = (char) c;
             }
-        }
 
-        return false;
-    }
+            return bytes;
+        }();
 
-    inline void document::normalize(std::string &s) {
-        to_lower(s);
-        remove_special_chars(s);
-    }
-    inline std::vector<std::string> document::tokenize(const std::string &text) {
-        auto terms = split(text, " ");
+        //resize keeps the capacity: no allocation once grown
+        scratch.resize(text.size());
+        tokens.clear();
 
-        for (auto &s : terms) {
-            normalize(s);
-        }
+        const auto size = text.size();
+        auto *out = scratch.data();
+        size_t start = 0;
 
-        return terms;
-    }
-    inline void document::stem(std::vector<std::string> &terms) {
-        const auto lambda = [](const std::string &term) { return is_stop(term); };
-        terms.erase(std::remove_if(terms.begin(), terms.end(), lambda), terms.end());
+        for (size_t i = 0; i < size; ++i) {
+            const auto c = word_bytes[(unsigned char) text[i]];
+            out[i] = c;
 
-        for (auto &term : terms) {
-            auto stemmed = sb_stemmer_stem(stemmer, (sb_symbol *) term.c_str(), (int) term.length());
-            term = (const char *) stemmed;
+            if (c != 0) continue;
+            if (i > start) tokens.emplace_back(out + start, i - start);
+
+            start = i + 1;
         }
+
+        if (size > start) tokens.emplace_back(out + start, size - start);
     }
 
     inline void document::write_block(std::stringstream &content, const std::string &type, const std::string &value) {
@@ -109,182 +100,1111 @@ namespace kissearch {
         value = s.substr(start, s.size() - start);
     }
 
-    document::document(const double &k, const double &b) {
+    document::document(const double &k, const double &b, const ulong &threads_count, const std::string &language) {
         this->k = k;
         this->b = b;
-        this->stemmer = sb_stemmer_new("english", nullptr);
+        this->threads_count = std::max(threads_count, 1UL);
+        set_language(language);
+        this->buffer = std::make_shared<segment>();
+        this->merge_thread = std::thread(&document::merge_segments, this);
+    }
+    void document::set_language(const std::string &language) {
+        if (thread_stemmer(language) == nullptr) throw std::invalid_argument("document: unknown language " + language);
+
+        this->language = language;
+        this->stops = find_stop_words(language);
+        this->stems_cache = std::make_shared<stem_cache>();
     }
     document::~document() {
-        sb_stemmer_delete(stemmer);
+        mutex.lock();
+        is_stopped = true;
+        mutex.unlock();
+
+        merge_condition.notify_all();
+        merge_thread.join();
+    }
+
+    inline double document::compute_idf(const ulong &entries_count, const ulong &entries_size) {
+        return std::log1p(((double) entries_size - (double) entries_count + 0.5) / ((double) entries_count + 0.5));
+    }
+    inline double document::compute_bm25(const ulong &tf, const double &idf, const ulong &terms_length, const double &avgdl, const double &k, const double &b) {
+        return idf * ((double) tf * (k + 1)) / ((double) tf + k * (1 - b + b * (double) terms_length / avgdl));
+    }
+    inline void document::bm25_parameters(const search_options &options, double &k, double &b) const {
+        k = options.k < 0 ? this->k : options.k;
+        b = options.b < 0 ? this->b : options.b;
+    }
+    ulong document::compute_next_number_value(const std::string &field_name) {
+        if (field_name == primary_key) return next_key_number;
+        if (entries.empty()) return 1;
+        return entries.back().find_field(field_name)._number->value + 1;
+    }
+
+    struct sb_stemmer *document::thread_stemmer(const std::string &language) {
+        //deleted when the thread exits
+        struct stemmers {
+            std::unordered_map<std::string, struct sb_stemmer *> by_language;
+
+            ~stemmers() {
+                for (auto &s : by_language) {
+                    sb_stemmer_delete(s.second);
+                }
+            }
+        };
+        static thread_local stemmers stemmers;
+
+        auto found = stemmers.by_language.find(language);
+        if (found != stemmers.by_language.end()) return found->second;
+
+        auto stemmer = sb_stemmer_new(language.c_str(), nullptr);
+        if (stemmer != nullptr) stemmers.by_language.emplace(language, stemmer);
+
+        return stemmer;
+    }
+    inline void document::analyze(stem_cache &cache, struct sb_stemmer *stemmer, const stop_words &stops, const std::string &text, analysis &analysis) {
+        tokenize(text, analysis.text, analysis.tokens);
+
+        analysis.stems.clear();
+        analysis.stem_ends.clear();
+        analysis.terms.clear();
+
+        for (uint32_t position = 0; position < analysis.tokens.size(); ++position) {
+            auto &token = analysis.tokens[position];
+            if (stops.contains(token)) continue;
+
+            cache.stem(token, stemmer, analysis.stems);
+            analysis.stem_ends.push_back((uint32_t) analysis.stems.size());
+            analysis.terms.emplace_back(std::string_view(), position);
+        }
+
+        //stems is final: the views of the terms
+        for (size_t i = 0, start = 0; i < analysis.terms.size(); start = analysis.stem_ends[i++]) {
+            analysis.terms[i].first = std::string_view(analysis.stems.data() + start, analysis.stem_ends[i] - start);
+        }
+    }
+    inline std::vector<std::pair<std::string, uint32_t>> document::analyze_query(const std::string &text) {
+        static thread_local analysis analysis;
+        analyze(*stems_cache, thread_stemmer(language), stops, text, analysis);
+
+        std::vector<std::pair<std::string, uint32_t>> terms;
+        terms.reserve(analysis.terms.size());
+
+        for (auto &term : analysis.terms) {
+            terms.emplace_back(term.first, term.second);
+        }
+
+        return terms;
+    }
+    inline std::vector<std::string> document::query_terms(const std::string &text) {
+        std::vector<std::string> terms;
+
+        for (auto &term : analyze_query(text)) {
+            terms.push_back(std::move(term.first));
+        }
+
+        return terms;
+    }
+
+    inline bool document::update_indexes() {
+        bool is_created = false;
+
+        for (auto &field : fields) {
+            if (field.second == "text") {
+                is_created = indexes.try_emplace(field.first).second || is_created;
+            }
+        }
+
+        return is_created;
     }
+    inline document::text_fields_t document::text_fields() const {
+        std::map<std::string, bool> by_name;
 
-    inline ulong document::compute_document_length_in_words(const std::string &field_name) {
-        ulong size = 0;
+        for (auto &field : fields) {
+            if (field.second == "text") by_name.emplace(field.first, false);
+        }
+        for (auto &index : indexes) {
+            by_name[index.first] = index.second.has_positions;
+        }
+
+        return text_fields_t(by_name.begin(), by_name.end());
+    }
+    inline bool document::analyze_field(entry &e, const std::string &field_name, const bool &has_positions, stem_cache &cache, struct sb_stemmer *stemmer, const stop_words &stops, analyzed_field &analyzed) {
+        analyzed.terms.clear();
+        analyzed.term_ends.clear();
+        analyzed.counts.clear();
+        analyzed.positions.clear();
+        analyzed.length = 0;
+
+        analyzed.has_field = e.has_field(field_name);
+        if (!analyzed.has_field) return false;
+
+        //reused by the entries of the thread (the workers of reindex have their own)
+        static thread_local analysis analysis;
+        analyze(cache, stemmer, stops, e.find_field(field_name)._text->value, analysis);
+
+        //equal terms are adjacent with their positions sorted, the length of a run is the term frequency
+        auto &terms = analysis.terms;
+        std::sort(terms.begin(), terms.end());
+
+        for (size_t i = 0, j; i < terms.size(); i = j) {
+            for (j = i; j < terms.size() && terms[j].first == terms[i].first; ++j) {
+                if (has_positions) analyzed.positions.push_back(terms[j].second);
+            }
 
-        for (auto &i : term_index) {
-            size += i.second.entries.size();
+            analyzed.terms.append(terms[i].first);
+            analyzed.term_ends.push_back((uint32_t) analyzed.terms.size());
+            analyzed.counts.push_back((uint32_t) (j - i));
         }
 
-        return size;
+        analyzed.length = terms.size();
+        return true;
     }
-    inline double document::compute_tf(entry &e, const std::string &term) {
-        auto tf = 0;
+    void document::analyze_entries(std::vector<entry> &es, const text_fields_t &text_fields, const std::string &language, stem_cache &cache, const stop_words &stops, std::vector<std::vector<analyzed_field>> &analyzed) {
+        auto stemmer = thread_stemmer(language);
+        analyzed.resize(es.size());
 
-        for (auto &i : term_index) {
-            auto found = i.second.entries.find(&e);
-            if (term == i.first && found != i.second.entries.end()) {
-                tf += found->second.count;
+        for (size_t i = 0; i < es.size(); ++i) {
+            analyzed[i].resize(text_fields.size());
+
+            for (size_t f = 0; f < text_fields.size(); ++f) {
+                analyze_field(es[i], text_fields[f].first, text_fields[f].second, cache, stemmer, stops, analyzed[i][f]);
             }
         }
+    }
+    inline void document::add_postings(const analyzed_field &analyzed, const entry_id_t &id, term_index_t &term_index) {
+        const uint32_t *positions = analyzed.positions.empty() ? nullptr : analyzed.positions.data();
+
+        //one posting per distinct term, a new term is appended to the arena of the index
+        for (size_t i = 0, start = 0; i < analyzed.counts.size(); start = analyzed.term_ends[i++]) {
+            const std::string_view term(analyzed.terms.data() + start, analyzed.term_ends[i] - start);
+            term_index.info(term_index.intern(term)).postings.push_back(id, analyzed.counts[i], (uint32_t) analyzed.length, positions);
+
+            if (positions != nullptr) positions += analyzed.counts[i];
+        }
+    }
+    inline bool document::find_key(const entry &e, std::string &key) const {
+        if (primary_key.empty()) return false;
+
+        for (auto &f : e.fields) {
+            if (f.name != primary_key) continue;
+
+            if (f.val.is_number()) key = std::to_string(f.val._number->value);
+            else if (f.val.is_keyword()) key = f.val._keyword->value;
+            else return false;
+
+            return true;
+        }
+
+        return false;
+    }
+    inline void document::index_key(const entry_id_t &id) {
+        std::string key;
+        if (!find_key(entries[id], key)) return;
+
+        auto found = keys.find(key);
+        if (found != keys.end()) remove_id(found->second);
 
-        return tf;
+        keys[key] = id;
+
+        auto &value = entries[id].find_field(primary_key);
+        if (value.is_number()) next_key_number = std::max(next_key_number, value._number->value + 1);
     }
-    void document::compute_idf(const ulong &entries_size) {
-        for (auto &i : term_index) {
-            auto size = i.second.entries.size();
-            i.second.idf = std::log1p(((double) entries_size - (double) size + 0.5) / ((double) size + 0.5));
+    inline void document::reindex_keys() {
+        keys.clear();
+
+        for (entry_id_t id = 0; id < entries.size(); ++id) {
+            if (live.is_live(id)) index_key(id);
         }
     }
-    inline double document::compute_bm25(entry &e, const std::string &term, const double &idf, const ulong &terms_length, const double &avgdl) {
-        auto tf = compute_tf(e, term);
-        return idf * (tf * (k + 1)) / (tf + k * (1 - b + b * terms_length / avgdl));
+    inline void document::index_entry(const entry_id_t &id, const text_fields_t &text_fields, const std::vector<analyzed_field> &analyzed) {
+        for (size_t f = 0; f < text_fields.size(); ++f) {
+            if (!analyzed[f].has_field) continue;
+
+            add_postings(analyzed[f], id, buffer->term_indexes[text_fields[f].first]);
+
+            auto &index = indexes[text_fields[f].first];
+            if (index.norms.size() <= id) index.norms.resize(id + 1, 0);
+            index.add_length(id, analyzed[f].length);
+        }
+
+        buffer->size = id + 1 - buffer->base;
+        if (buffer->size >= buffer_size) flush_buffer();
     }
-    int document::compute_damerau_levenshtein_distance(std::string s, std::string v) {
-        const ulong s_size = s.length();
-        const ulong v_size = v.length();
+    void document::reindex() {
+        update_indexes();
+
+        //the ids are rebuilt anyway, the removed entries are dropped before
+        if (live.removed_count > 0) {
+            entry_id_t next_id = 0;
+
+            for (entry_id_t id = 0; id < entries.size(); ++id) {
+                if (!live.is_live(id)) continue;
+                if (next_id != id) entries[next_id] = std::move(entries[id]);
+
+                ++next_id;
+            }
+
+            entries.erase(entries.begin() + next_id, entries.end());
+            live.clear();
+        }
 
-        int d[s_size + 1][v_size + 1];
-        int cost;
+        //the primary key can be set after the adds
+        reindex_keys();
 
-        for (int i = 0; i <= s_size; i++) d[i][0] = i;
-        for (int j = 0; j <= v_size; j++) d[0][j] = j;
-        for (int i = 1; i <= s_size; i++) {
-            for(int j = 1; j<= v_size; j++) {
-                if(s[i - 1] == v[j - 1]) cost = 0;
-                else cost = 1;
+        for (auto &index : indexes) {
+            index.second.clear();
+            index.second.norms.resize(entries.size(), 0);
+        }
 
-                d[i][j] = std::min(d[i-1][j] + 1, std::min(d[i][j-1] + 1, d[i-1][j-1] + cost));
+        struct field_stats {
+            ulong terms_length = 0;
+            ulong entries_count = 0;
+        };
 
-                if((i > 1) && (j > 1) && (s[i-1] == v[j-2]) && (s[i-2] == v[j-1])) {
-                    d[i][j] = std::min( d[i][j], d[i-2][j-2] + cost);
+        const auto entries_size = entries.size();
+        const auto workers_count = threads_count > 1 && entries_size > threads_count ? threads_count : 1;
+        const auto chunk_size = (entries_size + workers_count - 1) / workers_count;
+
+        //one segment per chunk of ids, the chunks are adjacent: no merge of partial indexes
+        std::vector<std::shared_ptr<segment>> built(workers_count);
+        std::vector<std::unordered_map<std::string, field_stats>> stats(workers_count);
+
+        const auto build = [&](const ulong &t) {
+            //the stemmer of the worker
+            auto worker_stemmer = thread_stemmer(language);
+            analyzed_field analyzed;
+            const auto from = std::min(t * chunk_size, entries_size);
+            const auto to = std::min(from + chunk_size, entries_size);
+
+            auto s = std::make_shared<segment>();
+            s->base = (entry_id_t) from;
+            s->size = (entry_id_t) (to - from);
+
+            for (auto &index : indexes) {
+                auto &term_index = s->term_indexes[index.first];
+                //norms are sized above, the chunks write their own ids
+                auto &norms = index.second.norms;
+                auto &field_stats = stats[t][index.first];
+
+                for (auto n = from; n < to; ++n) {
+                    if (!analyze_field(entries[n], index.first, index.second.has_positions, *stems_cache, worker_stemmer, stops, analyzed)) continue;
+
+                    add_postings(analyzed, (entry_id_t) n, term_index);
+                    norms[n] = posting_list::encode_length((uint32_t) analyzed.length);
+                    field_stats.terms_length += posting_list::decode_length(norms[n]);
+                    ++field_stats.entries_count;
                 }
+
+                term_index.seal();
+            }
+
+            built[t] = std::move(s);
+        };
+
+        if (workers_count == 1) {
+            build(0);
+        } else {
+            std::vector<std::thread> threads;
+            threads.reserve(workers_count);
+
+            for (ulong t = 0; t < workers_count; ++t) {
+                threads.emplace_back(build, t);
+            }
+
+            for (auto &thread : threads) {
+                thread.join();
+            }
+        }
+
+        segments.clear();
+
+        for (ulong t = 0; t < workers_count; ++t) {
+            if (built[t]->size > 0) segments.push_back(std::move(built[t]));
+
+            for (auto &i : stats[t]) {
+                auto &index = indexes[i.first];
+
+                index.terms_length += i.second.terms_length;
+                index.entries_count += i.second.entries_count;
             }
         }
 
-        return d[s_size][v_size];
+        buffer = std::make_shared<segment>();
+        buffer->base = (entry_id_t) entries_size;
+        merge_condition.notify_one();
     }
+    void document::flush_buffer() {
+        if (buffer->size == 0) return;
 
-    ulong document::compute_next_number_value(const std::string &field_name) {
-        if (entries.empty()) return 1;
-        return entries.back().find_field(field_name)._number->value + 1;
+        for (auto &term_index : buffer->term_indexes) {
+            term_index.second.seal();
+        }
+
+        const auto base = buffer->base + buffer->size;
+
+        segments.push_back(std::move(buffer));
+        buffer = std::make_shared<segment>();
+        buffer->base = base;
+
+        merge_condition.notify_one();
     }
 
-    void document::index() {
-        for (auto &field : fields) {
-            if (field.second == "text") {
-                index_text_field(field.first);
+    inline bool document::find_merge(size_t &from, size_t &to) const {
+        //tier: log of the size in buffers by merge_factor
+        const auto tier = [](const entry_id_t &size) {
+            size_t tier = 0;
+
+            for (ulong s = buffer_size; s * merge_factor <= size; s *= merge_factor) {
+                ++tier;
             }
+
+            return tier;
+        };
+
+        for (from = 0; from < segments.size(); from = to) {
+            const auto from_tier = tier(segments[from]->size);
+
+            for (to = from + 1; to < segments.size() && tier(segments[to]->size) == from_tier; ++to);
+
+            if (to - from >= merge_factor) {
+                to = from + merge_factor;
+                return true;
+            }
+        }
+
+        return false;
+    }
+    std::shared_ptr<document::segment> document::merge(const std::vector<std::shared_ptr<const segment>> &merged, const std::unordered_map<std::string, std::vector<uint8_t>> &norms) {
+        auto result = std::make_shared<segment>();
+        result->base = merged.front()->base;
+
+        std::vector<uint32_t> positions;
+
+        //in base order: the postings of a term are appended in id order
+        for (auto &s : merged) {
+            result->size += s->size;
+
+            for (auto &term_index : s->term_indexes) {
+                auto &field_norms = norms.at(term_index.first);
+                auto &merged_index = result->term_indexes[term_index.first];
+
+                for (auto term : term_index.second) {
+                    auto &postings = merged_index.info(merged_index.intern(term.first)).postings;
+
+                    for (auto it = term.second.postings.begin(); !it.is_end(); it.next()) {
+                        it.positions(positions);
+
+                        const auto length = posting_list::decode_length(field_norms[it.id() - result->base]);
+                        postings.push_back(it.id(), it.count(), length, positions.empty() ? nullptr : positions.data());
+                    }
+                }
+            }
+        }
+
+        for (auto &term_index : result->term_indexes) {
+            term_index.second.seal();
+        }
+
+        return result;
+    }
+    void document::merge_segments() {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        size_t from, to;
+
+        while (true) {
+            merge_condition.wait(lock, [&]() { return is_stopped || find_merge(from, to); });
+            if (is_stopped) return;
+
+            std::vector<std::shared_ptr<const segment>> merged(segments.begin() + (long) from, segments.begin() + (long) to);
+            const auto base = merged.front()->base;
+            const auto end = merged.back()->base + merged.back()->size;
+
+            //the norms of the merged entries, add() may grow the arrays meanwhile
+            std::unordered_map<std::string, std::vector<uint8_t>> norms;
+
+            for (auto &index : indexes) {
+                auto &field_norms = index.second.norms;
+                norms[index.first].assign(field_norms.begin() + std::min((size_t) base, field_norms.size()), field_norms.begin() + std::min((size_t) end, field_norms.size()));
+                norms[index.first].resize(end - base, 0);
+            }
+
+            //searches and adds go on while the segments are merged
+            lock.unlock();
+            auto result = merge(merged, norms);
+            lock.lock();
+
+            //a remove or a reindex has replaced the segments meanwhile
+            auto found = std::search(segments.begin(), segments.end(), merged.begin(), merged.end());
+            if (found == segments.end()) continue;
+
+            found = segments.erase(found, found + (long) merged.size());
+            segments.insert(found, std::move(result));
         }
     }
-    void document::index_text_field(const std::string &field_name) {
+
+    void document::index() {
         mutex.lock();
+        reindex();
+        mutex.unlock();
+    }
+    void document::index_text_field(const std::string &field_name, const bool &has_positions) {
+        mutex.lock();
+        auto &index = indexes[field_name];
+        index.has_positions = index.has_positions || has_positions;
+        reindex();
+        mutex.unlock();
+    }
+    void document::flush() {
+        mutex.lock();
+        flush_buffer();
+        mutex.unlock();
+    }
+    std::vector<std::shared_ptr<const document::segment>> document::get_segments() {
+        mutex.lock_shared();
+        auto result = segments;
+        mutex.unlock_shared();
+
+        return result;
+    }
+    ulong document::get_entries_count() {
+        mutex.lock_shared();
+        auto count = entries.size() - live.removed_count;
+        mutex.unlock_shared();
+
+        return count;
+    }
+
+    inline void document::page_bounds(const search_options &options, const size_t &size, size_t &from, size_t &to) {
+        from = std::min(size, (size_t) ((options.page - 1) * options.page_size));
+        to = std::min(size, (size_t) (options.page * options.page_size));
+    }
+    inline std::string document::encode_cursor(const double &score, const entry_id_t &id) {
+        //the exact bits: the hit compares equal to itself on the next page
+        uint64_t bits;
+        std::memcpy(&bits, &score, sizeof(bits));
+
+        char cursor[25];
+        std::snprintf(cursor, sizeof(cursor), "%016llx%08x", (unsigned long long) bits, (unsigned int) id);
 
-        //tokenize, stem
-        for (auto &entry : entries) {
-            auto &field = entry.find_field(field_name);
-            auto terms = split(field._text->value, " ");
+        return cursor;
+    }
+    inline void document::decode_cursor(const std::string &cursor, double &score, entry_id_t &id) {
+        if (cursor.size() != 24 || cursor.find_first_not_of("0123456789abcdef") != std::string::npos) {
+            throw std::invalid_argument("invalid search_after");
+        }
 
-            for (auto &s : terms) {
-                normalize(s);
+        const uint64_t bits = std::stoull(cursor.substr(0, 16), nullptr, 16);
+        std::memcpy(&score, &bits, sizeof(score));
+        id = (entry_id_t) std::stoul(cursor.substr(16), nullptr, 16);
+    }
+
+    inline std::string document::field_type(const std::string &field_name) {
+        if (indexes.find(field_name) != indexes.end()) return "text";
+
+        auto found = std::find_if(fields.begin(), fields.end(), [&](auto &f) { return f.first == field_name; });
+        return found == fields.end() ? "" : found->second;
+    }
+    inline bool document::parse_number(const std::string &value, ulong &number) {
+        const auto end = value.data() + value.size();
+        auto parsed = std::from_chars(value.data(), end, number);
+
+        return parsed.ec == std::errc() && parsed.ptr == end;
+    }
+    inline std::vector<document::term_postings> document::find_terms(const std::string &field_name, const std::vector<std::string> &terms, const search_options &options) const {
+        std::vector<term_postings> found;
+        std::unordered_map<std::string, size_t> positions;
+
+        for (size_t query = 0; query < terms.size(); ++query) {
+            auto &match_type = options.text._match_type;
+            //found terms of the query term: weight is the count of matched query terms, not of segments
+            std::unordered_set<size_t> matched;
+
+            //a query term matches a term in every segment with it, its postings come with the first query term
+            const auto add = [&](const std::string_view &term, const term_info &info) {
+                if (term.length() < options.text.word_min_size) return;
+                auto position = positions.emplace(term, found.size());
+
+                if (position.second) {
+                    found.emplace_back();
+                    found.back().term = term;
+                    found.back().first_query = query;
+                }
+
+                auto &t = found[position.first->second];
+                if (matched.insert(position.first->second).second) ++t.weight;
+                if (t.first_query != query) return;
+
+                t.postings.push_back(&info.postings);
+                t.df += info.postings.size();
+            };
+
+            for_each_segment([&](const segment &s) {
+                auto term_index = s.find(field_name);
+                if (term_index == nullptr) return;
+
+                if (match_type == options.text.match_type::strict) {
+                    auto info = term_index->find(terms[query]);
+                    if (info != nullptr) add(terms[query], *info);
+                } else if (match_type == options.text.match_type::fuzzy) {
+                    damerau_levenshtein_automaton automaton(terms[query], (uint32_t) options.text.fuzzy_max_damerau_levenshtein_distance);
+                    automaton.walk(term_index->sorted_view(), [&](const auto &i, const uint32_t &) { add(i->first, i->second); });
+                }
+            });
+        }
+
+        //the order of a single term index: the same sums whatever the segments
+        std::sort(found.begin(), found.end(), [](const auto &x, const auto &y) {
+            return x.first_query < y.first_query || (x.first_query == y.first_query && x.term < y.term);
+        });
+
+        return found;
+    }
+
+    document::search_result document::search_top_k(const std::vector<std::string> &terms, const search_options &options) {
+        const bool is_after = !options.search_after.empty();
+        const auto top_k = is_after ? options.page_size : options.page * options.page_size;
+
+        double after_score = 0;
+        entry_id_t after_id = 0;
+        if (is_after) decode_cursor(options.search_after, after_score, after_id);
+        //one cursor per matched term of a field, weight: matched query terms
+        struct cursor {
+            posting_list::iterator it;
+            const field_index *index;
+            double idf;
+            double avgdl;
+            double weight;
+            double max_score;
+        };
+        typedef std::pair<double, entry_id_t> hit_t;
+
+        std::vector<cursor> cursors;
+        double k, b;
+        bm25_parameters(options, k, b);
+
+        for (const auto &field_name : options.field_names) {
+            //a schema text field is indexed by the first add
+            auto found = indexes.find(field_name);
+            if (found == indexes.end()) continue;
+
+            auto &index = found->second;
+            const auto avgdl = index.avgdl();
+
+            //one cursor per segment of a term, their ids do not overlap
+            for (auto &term : find_terms(field_name, terms, options)) {
+                const auto idf = compute_idf(term.df, index.entries_count);
+                const auto weight = (double) term.weight;
+
+                for (auto postings : term.postings) {
+                    const auto max_score = weight * compute_bm25(postings->max_count(), idf, postings->min_length(), avgdl, k, b);
+                    cursors.push_back({ postings->begin(), &index, idf, avgdl, weight, max_score });
+                }
             }
+        }
+
+        std::vector<cursor *> order;
+        order.reserve(cursors.size());
+
+        for (auto &c : cursors) {
+            order.push_back(&c);
+        }
 
-            const auto lambda = [](const std::string &term) { return is_stop(term); };
-            terms.erase(std::remove_if(terms.begin(), terms.end(), lambda), terms.end());
+        //heap front: the worst hit, ties: the greater id is worse
+        const auto is_better = [](const hit_t &x, const hit_t &y) { return x.first > y.first || (x.first == y.first && x.second < y.second); };
+        //ties: the cursors order, scores are summed in the same order as the exhaustive search
+        const auto by_id = [](const cursor *x, const cursor *y) { return x->it.id() < y->it.id() || (x->it.id() == y->it.id() && x < y); };
 
-            for (auto &term : terms) {
-                auto stemmed = sb_stemmer_stem(stemmer, (sb_symbol *) term.c_str(), (int) term.length());
-                term = (const char *) stemmed;
-                ++term_index[term].entries[&entry].count;
+        //one more hit than the pages: a next page exists
+        const auto heap_size = top_k + 1;
+        std::vector<hit_t> heap;
+        heap.reserve(heap_size);
+        double threshold = 0;
+        ulong scored = 0;
+
+        while (true) {
+            std::sort(order.begin(), order.end(), by_id);
+
+            while (!order.empty() && order.back()->it.is_end()) {
+                order.pop_back();
             }
 
-            field._text->terms_length = terms.size();
+            //pivot: the first cursor where the max scores can beat the threshold
+            size_t pivot = order.size();
+            double upper_bound = 0;
+
+            for (size_t i = 0; i < order.size(); ++i) {
+                upper_bound += order[i]->max_score;
+
+                if (upper_bound > threshold) {
+                    pivot = i;
+                    break;
+                }
+            }
+
+            if (pivot == order.size()) break;
+            const auto pivot_id = order[pivot]->it.id();
+
+            while (pivot + 1 < order.size() && order[pivot + 1]->it.id() == pivot_id) {
+                ++pivot;
+            }
+
+            //block max: the pivot can still lose inside the current blocks
+            double block_upper_bound = 0;
+            entry_id_t next_id = posting_list::end_id;
+
+            for (size_t i = 0; i <= pivot; ++i) {
+                auto &c = *order[i];
+                auto block = c.it.shallow_advance(pivot_id);
+
+                block_upper_bound += c.weight * compute_bm25(block.max_count, c.idf, block.min_length, c.avgdl, k, b);
+                next_id = std::min(next_id, block.last_id + 1);
+            }
+            if (pivot + 1 < order.size()) {
+                next_id = std::min(next_id, order[pivot + 1]->it.id());
+            }
+
+            if (block_upper_bound <= threshold) {
+                for (size_t i = 0; i <= pivot; ++i) {
+                    order[i]->it.advance(next_id);
+                }
+
+                continue;
+            }
+
+            if (order[0]->it.id() != pivot_id) {
+                for (size_t i = 0; i < pivot && order[i]->it.id() < pivot_id; ++i) {
+                    order[i]->it.advance(pivot_id);
+                }
+
+                continue;
+            }
+
+            //a removed id keeps its postings until the compaction
+            if (!live.is_live(pivot_id)) {
+                for (size_t i = 0; i <= pivot; ++i) {
+                    order[i]->it.next();
+                }
+
+                continue;
+            }
+
+            double score = 0;
+
+            for (size_t i = 0; i <= pivot; ++i) {
+                auto &c = *order[i];
+
+                score += c.weight * compute_bm25(c.it.count(), c.idf, c.index->length(pivot_id), c.avgdl, k, b);
+                c.it.next();
+            }
+
+            ++scored;
+            //the previous pages
+            if (is_after && (score > after_score || (score == after_score && pivot_id <= after_id))) continue;
+
+            if (heap.size() < heap_size) {
+                heap.emplace_back(score, pivot_id);
+                std::push_heap(heap.begin(), heap.end(), is_better);
+
+                if (heap.size() == heap_size) threshold = heap.front().first;
+            } else if (score > threshold) {
+                std::pop_heap(heap.begin(), heap.end(), is_better);
+                heap.back() = { score, pivot_id };
+                std::push_heap(heap.begin(), heap.end(), is_better);
+
+                threshold = heap.front().first;
+            }
         }
 
-        auto entries_size = entries.size();
-        auto avgdl = (double) compute_document_length_in_words(field_name) / (double) entries_size;
-        compute_idf(entries_size);
+        std::sort(heap.begin(), heap.end(), is_better);
 
-        for (auto &i : term_index) {
-            for (auto &e : i.second.entries) {
-                auto &field = e.first->find_field(field_name);
-                e.second.score = compute_bm25(*e.first, i.first, i.second.idf, field._text->terms_length, avgdl);
+        search_result result;
+        //nothing was pruned before the heap was full
+        result.total_hits = scored;
+        result.is_total_hits_exact = heap.size() < heap_size;
+
+        const bool has_next = heap.size() > top_k;
+        if (has_next) heap.pop_back();
+
+        size_t from = 0, to = heap.size();
+        if (!is_after) page_bounds(options, heap.size(), from, to);
+        result.found.reserve(to - from);
+
+        for (auto i = from; i < to; ++i) {
+            result.found.push_back({ heap[i].second, heap[i].first, entry() });
+        }
+        if (has_next) {
+            result.next_cursor = encode_cursor(heap[to - 1].first, heap[to - 1].second);
+        }
+
+        return result;
+    }
+
+    inline posting_iterator::scorer_t document::bm25_scorer(const field_index &index, const ulong &df, const double &weight, const search_options &options) const {
+        const auto idf = compute_idf(df, index.entries_count);
+        const auto avgdl = index.avgdl();
+        double k, b;
+        bm25_parameters(options, k, b);
+
+        const auto *norms = &index;
+
+        return [norms, idf, avgdl, weight, k, b](const entry_id_t &id, const uint32_t &count) {
+            return weight * compute_bm25(count, idf, norms->length(id), avgdl, k, b);
+        };
+    }
+    inline document::term_match document::match_term(const query_node &node, const search_options &options) {
+        const auto field_names = node.field_name.empty() ? options.field_names : std::vector<std::string>{ node.field_name };
+        term_match match;
+
+        for (const auto &field_name : field_names) {
+            auto type = field_type(field_name);
+
+            if (type == "text") {
+                auto terms = query_terms(node.value);
+                if (terms.empty()) continue;
+
+                match.is_stop_only = false;
+                auto found = indexes.find(field_name);
+                auto &index = found->second;
+
+                for (auto &term : find_terms(field_name, terms, options)) {
+                    for (auto postings : term.postings) {
+                        match.postings.emplace_back(postings, bm25_scorer(index, term.df, (double) term.weight, options));
+                    }
+                }
+            } else if (!type.empty()) {
+                match.is_stop_only = false;
+                std::vector<entry_id_t> ids;
+
+                //parsed once, not by every field compare
+                ulong number = 0;
+                if (type == "number" && !parse_number(node.value, number)) continue;
+
+                for (entry_id_t id = 0; id < entries.size(); ++id) {
+                    auto &entry = entries[id];
+                    if (!live.is_live(id) || !entry.has_field(field_name)) continue;
+
+                    auto &field = entry.find_field(field_name);
+
+                    if ((type == "number" && field._number->operator==(number))
+                        || (type == "keyword" && field._keyword->operator==(node.value))
+                        || (type == "boolean" && field._boolean->operator==(node.value))) {
+                        ids.push_back(id);
+                    }
+                }
+
+                if (!ids.empty()) match.filters.push_back(std::move(ids));
+            } else {
+                match.is_stop_only = false;
             }
         }
 
-        mutex.unlock();
+        return match;
+    }
+    inline query_iterator_ptr document::compile(term_match &match) {
+        std::vector<query_iterator_ptr> children;
+
+        for (auto &p : match.postings) {
+            children.push_back(std::make_unique<posting_iterator>(*p.first, std::move(p.second)));
+        }
+        for (auto &f : match.filters) {
+            children.push_back(std::make_unique<ids_iterator>(std::move(f)));
+        }
+
+        if (children.empty()) return std::make_unique<ids_iterator>(std::vector<entry_id_t>());
+        if (children.size() == 1) return std::move(children.front());
+
+        return std::make_unique<disjunction_iterator>(std::move(children));
+    }
+    inline std::vector<document::entry_id_t> document::match_ids(const term_match &match, const std::vector<entry_id_t> *candidates) {
+        std::vector<entry_id_t> ids;
+        bool is_first = true;
+
+        const auto add = [&](std::vector<entry_id_t> found) {
+            ids = is_first ? std::move(found) : unite(ids, found);
+            is_first = false;
+        };
+
+        for (auto &p : match.postings) {
+            add(candidates ? p.first->intersect(*candidates) : p.first->ids());
+        }
+        for (auto &f : match.filters) {
+            add(candidates ? intersect(f, *candidates) : f);
+        }
+
+        return ids;
     }
 
-    inline void document::slice_page(std::vector<result_t> &results, const search_options &options) {
-        const auto page_size_max = options.page * options.page_size;
-        const auto page_size_min = page_size_max - options.page_size;
+    query_iterator_ptr document::compile_positional(const query_node &node, const search_options &options) {
+        const auto field_names = node.field_name.empty() ? options.field_names : std::vector<std::string>{ node.field_name };
+
+        //words with their positions in the phrase, stop words are gaps
+        std::vector<std::pair<std::string, uint32_t>> words;
 
-        std::vector<result_t> results_tmp;
-        results_tmp.reserve(options.page_size);
+        if (node.type == query_node::phrase) {
+            words = analyze_query(node.value);
+        } else {
+            //the iterator compares the positions of two terms: a stop word or a word split in several terms has no single position
+            for (auto &child : node.children) {
+                auto analyzed = analyze_query(child.value);
+                if (analyzed.size() != 1) throw std::invalid_argument("query: NEAR needs one term on each side, not " + child.value);
 
-        for (int i = 0; i < results.size(); ++i) {
-            if (i >= page_size_min && i < page_size_max) {
-                results_tmp.push_back(results[i]);
+                words.push_back(std::move(analyzed.front()));
             }
         }
 
-        results = results_tmp;
+        std::vector<query_iterator_ptr> children;
+
+        for (const auto &field_name : field_names) {
+            auto found = indexes.find(field_name);
+            if (found == indexes.end()) continue;
+
+            auto &index = found->second;
+
+            //the idf of a word is over the segments
+            std::vector<ulong> dfs(words.size(), 0);
+
+            for_each_segment([&](const segment &s) {
+                auto term_index = s.find(field_name);
+                if (term_index == nullptr) return;
+
+                for (size_t i = 0; i < words.size(); ++i) {
+                    auto info = term_index->find(words[i].first);
+                    if (info != nullptr) dfs[i] += info->postings.size();
+                }
+            });
+
+            //a match is inside one segment: one positional iterator per segment with every word
+            //positions are opt-in: without them every word of the field matches
+            for_each_segment([&](const segment &s) {
+                auto term_index = s.find(field_name);
+                if (term_index == nullptr) return;
+
+                std::vector<std::unique_ptr<posting_iterator>> terms;
+                std::vector<uint32_t> offsets;
+
+                for (size_t i = 0; i < words.size(); ++i) {
+                    auto info = term_index->find(words[i].first);
+                    if (info == nullptr) break;
+
+                    terms.push_back(std::make_unique<posting_iterator>(info->postings, bm25_scorer(index, dfs[i], 1, options)));
+                    offsets.push_back(words[i].second - words.front().second);
+                }
+
+                if (terms.empty() || terms.size() < words.size()) return;
+
+                if (terms.size() == 1) {
+                    children.push_back(std::move(terms.front()));
+                } else if (!index.has_positions) {
+                    children.push_back(std::make_unique<conjunction_iterator>(std::vector<query_iterator_ptr>(std::make_move_iterator(terms.begin()), std::make_move_iterator(terms.end())), std::vector<query_iterator_ptr>()));
+                } else {
+                    const auto type = node.type == query_node::phrase ? positional_iterator::phrase : positional_iterator::near;
+                    children.push_back(std::make_unique<positional_iterator>(std::move(terms), std::move(offsets), type, node.distance));
+                }
+            });
+        }
+
+        if (words.empty()) return nullptr;
+
+        if (children.empty()) return std::make_unique<ids_iterator>(std::vector<entry_id_t>());
+        if (children.size() == 1) return std::move(children.front());
+
+        return std::make_unique<disjunction_iterator>(std::move(children));
     }
+    query_iterator_ptr document::compile(const query_node &node, const search_options &options) {
+        if (node.type == query_node::phrase || node.type == query_node::proximity) {
+            return compile_positional(node, options);
+        }
+        if (node.type == query_node::term) {
+            auto match = match_term(node, options);
+            if (match.is_stop_only) return nullptr;
+
+            return compile(match);
+        }
+
+        if (node.type == query_node::conjunction) {
+            std::vector<query_iterator_ptr> children, excluded;
+            std::vector<term_match> terms, excluded_terms;
+
+            for (auto &child : node.children) {
+                const bool is_negation = child.type == query_node::negation;
+                auto &operand = is_negation ? child.children.front() : child;
+
+                if (operand.type == query_node::term) {
+                    auto match = match_term(operand, options);
+                    if (!match.is_stop_only) (is_negation ? excluded_terms : terms).push_back(std::move(match));
+
+                    continue;
+                }
+
+                auto it = compile(operand, options);
+                if (it) (is_negation ? excluded : children).push_back(std::move(it));
+            }
+
+            std::sort(terms.begin(), terms.end(), [](const auto &x, const auto &y) { return x.cost() < y.cost(); });
+
+            //skewed terms: the leapfrog already skips the long lists by the rarest
+            const bool is_dense = terms.size() > 1 && terms[1].cost() < terms[0].cost() * galloping_ratio;
+
+            if (!is_dense) {
+                for (auto &term : terms) {
+                    children.push_back(compile(term));
+                }
+            } else {
+                //candidates of the terms: intersected from the cheapest by the simd kernels, only their blocks are decoded
+                auto candidates = match_ids(terms.front(), nullptr);
+
+                for (size_t i = 1; i < terms.size() && !candidates.empty(); ++i) {
+                    candidates = match_ids(terms[i], &candidates);
+                }
+                for (auto &term : excluded_terms) {
+                    auto found = match_ids(term, &candidates);
+                    std::vector<entry_id_t> rest;
+
+                    std::set_difference(candidates.begin(), candidates.end(), found.begin(), found.end(), std::back_inserter(rest));
+                    candidates = std::move(rest);
+                }
+
+                excluded_terms.clear();
+                //leads the conjunction, the term iterators only score its ids
+                children.push_back(std::make_unique<ids_iterator>(std::move(candidates), 0));
+
+                for (auto &term : terms) {
+                    children.push_back(compile(term));
+                }
+            }
+            for (auto &term : excluded_terms) {
+                excluded.push_back(compile(term));
+            }
+
+            if (children.empty() && excluded.empty()) return nullptr;
+            if (children.empty()) children.push_back(std::make_unique<all_iterator>((entry_id_t) entries.size()));
+            if (children.size() == 1 && excluded.empty()) return std::move(children.front());
+
+            return std::make_unique<conjunction_iterator>(std::move(children), std::move(excluded));
+        }
+
+        if (node.type == query_node::negation) {
+            auto it = compile(node.children.front(), options);
+            if (!it) return nullptr;
+
+            std::vector<query_iterator_ptr> children, excluded;
+            children.push_back(std::make_unique<all_iterator>((entry_id_t) entries.size()));
+            excluded.push_back(std::move(it));
+
+            return std::make_unique<conjunction_iterator>(std::move(children), std::move(excluded));
+        }
+
+        std::vector<query_iterator_ptr> children;
+
+        for (auto &child : node.children) {
+            auto it = compile(child, options);
+            if (it) children.push_back(std::move(it));
+        }
+
+        if (children.empty()) return nullptr;
+        if (children.size() == 1) return std::move(children.front());
+
+        return std::make_unique<disjunction_iterator>(std::move(children));
+    }
+
+    document::search_result document::search(const std::string &query, const search_options &options, const bool is_all) {
+        //searches run together, an add waits for them
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        auto result = search_locked(query, options, is_all);
+
+        //the entries of the page: the vector can move once the lock is released
+        for (auto &r : result.found) {
+            r.e = entries[r.id];
+        }
+
+        return result;
+    }
+    document::search_result document::search_locked(const std::string &query, const search_options &options, const bool &is_all) {
+        //a page 0 or an empty page: no top k, (page - 1) * page_size wraps
+        if (!is_all && (options.page < 1 || options.page_size < 1)) throw std::invalid_argument("page and page_size start at 1");
+
+        //reused by the queries of the thread, no allocation once it has grown
+        static thread_local accumulator hits;
+
+        //a conjunction only visits the ids of its rarest child
+        const auto is_field = [&](const std::string &field_name) { return !field_type(field_name).empty(); };
+        query_node root_node;
+        auto is_boolean = is_boolean_query(query, is_field);
+
+        if (is_boolean) {
+            //a dangling operator or an unclosed parenthesis: searched as plain words
+            try {
+                root_node = parse_query(query, is_field);
+            } catch (const query_syntax_error &) {
+                is_boolean = false;
+            }
+        }
+
+        if (is_boolean) {
+            auto root = compile(root_node, options);
+
+            hits.clear();
+            hits.resize(entries.size());
+
+            for (; root && root->id() != posting_list::end_id; root->next()) {
+                if (live.is_live(root->id())) hits.set(root->id(), root->score());
+            }
+
+            return collect(hits, options, is_all);
+        }
+
+        auto terms = query_terms(query);
+
+        //ranked text pages: only the top page * page_size are scored
+        const auto lambda_text = [&](const std::string &field_name) { return field_type(field_name) == "text"; };
+        if (!is_all && options.sort_by_score && !options.track_total_hits && std::all_of(options.field_names.begin(), options.field_names.end(), lambda_text)) {
+            return search_top_k(terms, options);
+        }
 
-    std::vector<document::result_t> document::search(const std::string &query, const search_options &options, const bool is_all) {
-        auto terms = tokenize(query);
-        stem(terms);
+        hits.clear();
+        hits.resize(entries.size());
 
-        std::vector<result_t> results;
-        results.reserve(options.page_size);
+        double k, b;
+        bm25_parameters(options, k, b);
 
         for (const auto &field_name : options.field_names) {
-            auto type = std::find_if(fields.begin(), fields.end(),[&](auto &f) { return f.first == field_name; })->second;
+            auto type = field_type(field_name);
 
             if (type == "text") {
-                for (auto &i : term_index) {
-                    for (auto &term : terms) {
-                        if (i.first.length() < options.text.word_min_size) continue;
-                        auto &match_type = options.text._match_type;
-
-                        if (match_type == options.text.match_type::strict) {
-                            if (i.first != term) {
-                                continue;
-                            }
-                        } else if (match_type == options.text.match_type::fuzzy) {
-                            if (compute_damerau_levenshtein_distance(i.first, term) > options.text.fuzzy_max_damerau_levenshtein_distance) {
-                                continue;
-                            }
-                        }
+                auto found = indexes.find(field_name);
+                if (found == indexes.end()) continue;
 
-                        for (auto &entry : i.second.entries) {
-                            auto &score = entry.second.score;
-                            if (score <= 0) continue;
+                auto &index = found->second;
+                const auto avgdl = index.avgdl();
+
+                for (auto &term : find_terms(field_name, terms, options)) {
+                    const auto idf = compute_idf(term.df, index.entries_count);
 
-                            const auto lambda = [&](const result_t &c) { return c.first == entry.first; };
-                            auto found = std::find_if(results.begin(), results.end(), lambda);
+                    for (auto postings : term.postings) {
+                        for (auto it = postings->begin(); !it.is_end(); it.next()) {
+                            if (!live.is_live(it.id())) continue;
 
-                            if (found != results.end()) found->second += score;
-                            else results.emplace_back(entry.first, score);
+                            auto score = (double) term.weight * compute_bm25(it.count(), idf, index.length(it.id()), avgdl, k, b);
+                            if (score <= 0) continue;
+
+                            hits.add(it.id(), score);
                         }
                     }
                 }
-            } else {
-                for (auto &entry : entries) {
+            } else if (!type.empty()) {
+                const bool is_number = type == "number";
+                ulong number = 0;
+                if (is_number && !parse_number(query, number)) continue;
+
+                for (entry_id_t id = 0; id < entries.size(); ++id) {
+                    auto &entry = entries[id];
+                    if (!live.is_live(id) || !entry.has_field(field_name)) continue;
+
                     auto &field = entry.find_field(field_name);
                     double score = 0;
 
-                    if (type == "number") {
-                        if (field._number->operator==(std::stol(query))) {
+                    if (is_number) {
+                        if (field._number->operator==(number)) {
                             score = 1;
                         }
                     } else if (type == "keyword") {
@@ -298,46 +1218,298 @@ namespace kissearch {
                     }
 
                     if (score <= 0) continue;
-
-                    const auto lambda = [&](const result_t &c) { return c.first == &entry; };
-                    auto found = std::find_if(results.begin(), results.end(), lambda);
-
-                    if (found != results.end()) found->second += score;
-                    else results.emplace_back(&entry, score);
+                    hits.add(id, score);
                 }
             }
         }
 
-        if (options.sort_by_score) {
-            std::sort(results.begin(), results.end(), [](const auto &x, const auto &y) {
-                return x.second > y.second;
+        return collect(hits, options, is_all);
+    }
+    document::search_result document::collect(accumulator &hits, const search_options &options, const bool &is_all) {
+        auto &ids = hits.ids;
+        const auto &scores = hits.scores;
+        const bool is_after = !options.search_after.empty();
+        const bool is_ranked = options.sort_by_score || is_after;
+
+        //candidates: [ids.begin(), last), the hits of the previous pages are moved after last
+        auto last = ids.end();
+
+        if (is_after) {
+            double after_score;
+            entry_id_t after_id;
+            decode_cursor(options.search_after, after_score, after_id);
+
+            last = std::partition(ids.begin(), ids.end(), [&](const entry_id_t &id) {
+                return scores[id] < after_score || (scores[id] == after_score && id > after_id);
             });
         }
-        if (!is_all) slice_page(results, options);
 
-        return results;
+        const auto size = (size_t) (last - ids.begin());
+        size_t from = 0, to = size;
+
+        if (is_after) to = is_all ? size : std::min(size, (size_t) options.page_size);
+        else if (!is_all) page_bounds(options, size, from, to);
+
+        if (is_ranked) {
+            //ties: the smaller id first, only the ids up to the page are ordered
+            const auto is_better = [&](const entry_id_t &x, const entry_id_t &y) {
+                return scores[x] > scores[y] || (scores[x] == scores[y] && x < y);
+            };
+
+            if (to < size) {
+                std::nth_element(ids.begin(), ids.begin() + (long) to, last, is_better);
+            }
+            std::sort(ids.begin(), ids.begin() + (long) to, is_better);
+        }
+
+        search_result result;
+        result.total_hits = ids.size();
+        result.found.reserve(to - from);
+
+        for (auto i = from; i < to; ++i) {
+            result.found.push_back({ ids[i], scores[ids[i]], entry() });
+        }
+        //hits after the page
+        if (is_ranked && !is_all && to < size) {
+            result.next_cursor = encode_cursor(scores[ids[to - 1]], ids[to - 1]);
+        }
+
+        return result;
     }
 
+    inline bool document::remove_id(const entry_id_t &id) {
+        if (id >= entries.size() || !live.remove(id)) return false;
+
+        std::string key;
+
+        if (find_key(entries[id], key)) {
+            auto found = keys.find(key);
+            if (found != keys.end() && found->second == id) keys.erase(found);
+        }
+
+        return true;
+    }
+    void document::compact_removed() {
+        if (live.removed_count == 0) return;
+
+        //old id -> new id, removed: -1
+        std::vector<int64_t> ids(entries.size());
+        entry_id_t next_id = 0;
+
+        for (entry_id_t id = 0; id < entries.size(); ++id) {
+            if (live.is_live(id)) {
+                ids[id] = next_id++;
+                continue;
+            }
+
+            ids[id] = -1;
+
+            for (auto &index : indexes) {
+                if (id < index.second.norms.size() && entries[id].has_field(index.first)) index.second.remove_length(id);
+            }
+        }
+
+        flush_buffer();
+
+        //one pass over the postings of every segment: drop the removed ids, shift the others, the order is kept
+        //the segments are rebuilt, a running merge of the old ones is dropped
+        std::vector<std::shared_ptr<const segment>> rebuilt;
+        std::vector<uint32_t> positions;
+        entry_id_t base = 0;
+
+        for (auto &s : segments) {
+            auto r = std::make_shared<segment>();
+            r->base = base;
+
+            for (auto id = s->base; id < s->base + s->size; ++id) {
+                if (ids[id] >= 0) ++r->size;
+            }
+
+            for (auto &term_index : s->term_indexes) {
+                auto &index = indexes[term_index.first];
+                auto &rebuilt_index = r->term_indexes[term_index.first];
+
+                for (auto term : term_index.second) {
+                    posting_list postings;
+
+                    for (auto posting = term.second.postings.begin(); !posting.is_end(); posting.next()) {
+                        auto id = ids[posting.id()];
+                        if (id < 0) continue;
+
+                        posting.positions(positions);
+                        postings.push_back((entry_id_t) id, posting.count(), index.length(posting.id()), positions.empty() ? nullptr : positions.data());
+                    }
+
+                    if (postings.empty()) continue;
+
+                    postings.seal();
+                    rebuilt_index.info(rebuilt_index.intern(term.first)).postings = std::move(postings);
+                }
+
+                rebuilt_index.seal();
+            }
+
+            base += r->size;
+            if (r->size > 0) rebuilt.push_back(std::move(r));
+        }
+
+        segments = std::move(rebuilt);
+        buffer->base = next_id;
+
+        for (auto &key : keys) {
+            key.second = (entry_id_t) ids[key.second];
+        }
+
+        for (entry_id_t id = 0; id < entries.size(); ++id) {
+            if (ids[id] >= 0 && ids[id] != id) {
+                entries[ids[id]] = std::move(entries[id]);
+            }
+        }
+
+        entries.erase(entries.begin() + next_id, entries.end());
+
+        //the norms move with their entries
+        for (auto &index : indexes) {
+            auto &norms = index.second.norms;
+            norms.resize(ids.size(), 0);
+
+            for (entry_id_t id = 0; id < ids.size(); ++id) {
+                if (ids[id] >= 0) norms[ids[id]] = norms[id];
+            }
+
+            norms.resize(next_id);
+        }
+
+        live.clear();
+    }
+    inline void document::compact_if_removed() {
+        if (live.removed_count * compaction_ratio >= entries.size()) compact_removed();
+    }
     void document::remove(const entry &e) {
         mutex.lock();
-        for (int i = 0; i < entries.size(); ++i) {
-            if (entries[i] == e) {
-                entries.erase(entries.begin() + i);
-                --i;
-            }
+
+        for (entry_id_t id = 0; id < entries.size(); ++id) {
+            if (entries[id] == e) remove_id(id);
+        }
+
+        compact_if_removed();
+        mutex.unlock();
+    }
+    void document::remove(const std::vector<entry_id_t> &ids) {
+        mutex.lock();
+
+        for (auto &id : ids) {
+            remove_id(id);
         }
+
+        compact_if_removed();
+        mutex.unlock();
+    }
+    ulong document::remove(const std::string &query, const search_options &options) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto results = search_locked(query, options, true).found;
+
+        for (auto &result : results) {
+            remove_id(result.id);
+        }
+
+        compact_if_removed();
+        return results.size();
+    }
+    void document::compact() {
+        mutex.lock();
+        compact_removed();
+        mutex.unlock();
+    }
+    bool document::remove_by_key(const std::string &key) {
+        mutex.lock();
+
+        auto found = keys.find(key);
+        const bool is_found = found != keys.end();
+
+        if (is_found) {
+            remove_id(found->second);
+            compact_if_removed();
+        }
+
+        mutex.unlock();
+        return is_found;
+    }
+    void document::upsert(const entry &e) {
+        std::string key;
+        if (!find_key(e, key)) throw std::invalid_argument("upsert: no primary key " + primary_key);
+
+        add_entries({ e });
+    }
+    std::optional<entry> document::find_by_key(const std::string &key) {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+
+        auto found = keys.find(key);
+        if (found == keys.end()) return std::nullopt;
+
+        return entries[found->second];
+    }
+    void document::add_entries(std::vector<entry> es) {
+        mutex.lock_shared();
+        auto indexed_fields = text_fields();
+        auto language = this->language;
+        auto stops = this->stops;
+        auto cache = stems_cache;
+        mutex.unlock_shared();
+
+        std::vector<std::vector<analyzed_field>> analyzed;
+        analyze_entries(es, indexed_fields, language, *cache, stops, analyzed);
+
+        mutex.lock();
+
+        //a text field declared after the adds: the entries before are indexed and counted by its index
+        if (update_indexes() && !entries.empty()) reindex();
+
+        //a text field was indexed or the language changed meanwhile: rare, analyzed again
+        if (indexed_fields != text_fields() || language != this->language) {
+            indexed_fields = text_fields();
+            analyze_entries(es, indexed_fields, this->language, *stems_cache, this->stops, analyzed);
+        }
+
+        entries.reserve(entries.size() + es.size());
+
+        for (size_t i = 0; i < es.size(); ++i) {
+            entries.push_back(std::move(es[i]));
+
+            const auto id = (entry_id_t) (entries.size() - 1);
+            index_entry(id, indexed_fields, analyzed[i]);
+            index_key(id);
+        }
+
+        compact_if_removed();
         mutex.unlock();
     }
     void document::add(const entry &e) {
+        add_entries({ e });
+    }
+    void document::add(const std::vector<entry> &es) {
+        add_entries(es);
+    }
+    void document::clear() {
         mutex.lock();
-        this->entries.push_back(e);
+        entries.clear();
+        segments.clear();
+        buffer = std::make_shared<segment>();
+        live.clear();
+        keys.clear();
+        next_key_number = 1;
+
+        for (auto &index : indexes) {
+            const auto has_positions = index.second.has_positions;
+
+            index.second = field_index();
+            index.second.has_positions = has_positions;
+        }
         mutex.unlock();
     }
 
     void document::load(const std::string &file_name) {
-        if (!entries.empty()) {
-            entries.clear();
-        }
+        clear();
 
         auto decompressed = compression::decompress(get_file_content(file_name));
         std::stringstream stream(decompressed);
@@ -388,12 +1560,16 @@ namespace kissearch {
                 e.fields.push_back(f);
             } else if (t == 'm') { //global field name
                 field_name = value;
-            } else if (t == 'l') { //global field value
-                fields.emplace_back(field_name, value);
+            } else if (t == 'l') { //global field value, inside an entry: the terms length of older files
+                if (e.fields.empty()) fields.emplace_back(field_name, value);
+            } else if (t == 'p') { //text field with positions
+                indexes[value].has_positions = true;
+            } else if (t == 'u') { //primary key field
+                primary_key = value;
+            } else if (t == 'g') { //language, before the entries
+                set_language(value);
             }
         }
-
-        index();
     }
     void document::save(const std::string &file_name) {
         if (std::filesystem::exists(file_name)) {
@@ -402,6 +1578,7 @@ namespace kissearch {
 
         std::stringstream content;
         write_block(content, "d", name);
+        write_block(content, "g", language);
 
         /*for (auto &i : term_index) {
             write_block(content, "i", i.first);
@@ -418,8 +1595,15 @@ namespace kissearch {
             write_block(content, "m", i.first);
             write_block(content, "l", i.second);
         }
+        for (auto &i : indexes) {
+            if (i.second.has_positions) write_block(content, "p", i.first);
+        }
+        if (!primary_key.empty()) write_block(content, "u", primary_key);
+
+        for (entry_id_t id = 0; id < entries.size(); ++id) {
+            if (!live.is_live(id)) continue;
+            auto &entry = entries[id];
 
-        for (auto &entry : entries) {
             for (auto &f : entry.fields) {
                 std::string type;
                 std::string value;
@@ -439,10 +1623,6 @@ namespace kissearch {
                 }
 
                 write_block(content, f.name, type, value);
-
-                if (type == "t") {
-                    write_block(content, "l", std::to_string(f.val._text->terms_length));
-                }
             }
 
             content << ";" << std::endl;
@@ -0,0 +1,299 @@
+#include "../include/intersection.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KISSEARCH_X86
+#include <immintrin.h>
+#endif
+
+namespace kissearch {
+#ifdef KISSEARCH_X86
+    namespace {
+        //shuffles moving the lanes of a mask to the front: pshufb bytes for 4 lanes, permute indexes for 8 lanes
+        struct compress_tables {
+            alignas(16) uint8_t sse[16][16];
+            alignas(32) uint32_t avx2[256][8];
+
+            compress_tables() {
+                for (uint32_t mask = 0; mask < 16; ++mask) {
+                    uint32_t lane = 0;
+
+                    for (uint32_t i = 0; i < 4; ++i) {
+                        if (!(mask & (1 << i))) continue;
+
+                        for (uint32_t j = 0; j < 4; ++j) {
+                            sse[mask][lane * 4 + j] = (uint8_t) (i * 4 + j);
+                        }
+
+                        ++lane;
+                    }
+                    for (; lane < 4; ++lane) {
+                        for (uint32_t j = 0; j < 4; ++j) {
+                            sse[mask][lane * 4 + j] = 0x80;
+                        }
+                    }
+                }
+
+                for (uint32_t mask = 0; mask < 256; ++mask) {
+                    uint32_t lane = 0;
+
+                    for (uint32_t i = 0; i < 8; ++i) {
+                        if (mask & (1 << i)) avx2[mask][lane++] = i;
+                    }
+                    for (; lane < 8; ++lane) {
+                        avx2[mask][lane] = 0;
+                    }
+                }
+            }
+        };
+        const compress_tables tables;
+
+        //4 + 4 sorted lanes -> the 4 smallest in vmin, the 4 greatest in vmax, both sorted
+        __attribute__((target("sse4.2")))
+        inline void merge(const __m128i &a, const __m128i &b, __m128i &vmin, __m128i &vmax) {
+            __m128i tmp = _mm_min_epu32(a, b);
+            vmax = _mm_max_epu32(a, b);
+
+            for (int i = 0; i < 3; ++i) {
+                tmp = _mm_alignr_epi8(tmp, tmp, 4);
+                vmin = _mm_min_epu32(tmp, vmax);
+                vmax = _mm_max_epu32(tmp, vmax);
+                tmp = vmin;
+            }
+
+            vmin = _mm_alignr_epi8(vmin, vmin, 4);
+        }
+        //lanes of values not equal to the lane before (lane 3 of previous before lane 0), returns the count
+        __attribute__((target("sse4.2")))
+        inline size_t store_unique(const __m128i &previous, const __m128i &values, uint32_t *out) {
+            const __m128i before = _mm_alignr_epi8(values, previous, 12);
+            const int keep = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(before, values))) & 0xF;
+
+            _mm_storeu_si128((__m128i *) out, _mm_shuffle_epi8(values, *(const __m128i *) tables.sse[keep]));
+            return (size_t) __builtin_popcount(keep);
+        }
+    }
+
+    bool has_sse42() {
+        static const bool is = __builtin_cpu_supports("sse4.2");
+        return is;
+    }
+    bool has_avx2() {
+        static const bool is = __builtin_cpu_supports("avx2");
+        return is;
+    }
+#else
+    bool has_sse42() { return false; }
+    bool has_avx2() { return false; }
+#endif
+
+    size_t intersect_scalar(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out) {
+        size_t i = 0, j = 0, k = 0;
+
+        while (i < a_size && j < b_size) {
+            if (a[i] < b[j]) {
+                ++i;
+            } else if (b[j] < a[i]) {
+                ++j;
+            } else {
+                out[k++] = a[i];
+                ++i;
+                ++j;
+            }
+        }
+
+        return k;
+    }
+    size_t intersect_galloping(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out) {
+        //each id of the small list: doubling steps in the long one, then a binary search of the last step
+        if (a_size > b_size) return intersect_galloping(b, b_size, a, a_size, out);
+
+        size_t j = 0, k = 0;
+
+        for (size_t i = 0; i < a_size && j < b_size; ++i) {
+            const auto target = a[i];
+
+            if (b[j] < target) {
+                size_t low = j, step = 1, high = j + 1;
+
+                while (high < b_size && b[high] < target) {
+                    low = high;
+                    step <<= 1;
+                    high = j + step;
+                }
+
+                j = std::lower_bound(b + low + 1, b + std::min(high, b_size), target) - b;
+            }
+
+            if (j < b_size && b[j] == target) {
+                out[k++] = target;
+                ++j;
+            }
+        }
+
+        return k;
+    }
+
+#ifdef KISSEARCH_X86
+    __attribute__((target("sse4.2")))
+    size_t intersect_sse42(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out) {
+        size_t i = 0, j = 0, k = 0;
+
+        //4 x 4 comparisons: b rotated 3 times, the last ids decide which side moves on
+        while (i + 4 <= a_size && j + 4 <= b_size) {
+            const __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+            const __m128i vb = _mm_loadu_si128((const __m128i *) (b + j));
+
+            const __m128i cmp = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi32(va, vb), _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+                    _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))), _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+            const int mask = _mm_movemask_ps(_mm_castsi128_ps(cmp));
+
+            _mm_storeu_si128((__m128i *) (out + k), _mm_shuffle_epi8(va, *(const __m128i *) tables.sse[mask]));
+            k += (size_t) __builtin_popcount(mask);
+
+            const auto a_max = a[i + 3];
+            const auto b_max = b[j + 3];
+
+            if (a_max <= b_max) i += 4;
+            if (b_max <= a_max) j += 4;
+        }
+
+        return k + intersect_scalar(a + i, a_size - i, b + j, b_size - j, out + k);
+    }
+    __attribute__((target("avx2")))
+    size_t intersect_avx2(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out) {
+        size_t i = 0, j = 0, k = 0;
+        const __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+
+        //8 x 8 comparisons: b rotated 7 times
+        while (i + 8 <= a_size && j + 8 <= b_size) {
+            const __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+            __m256i vb = _mm256_loadu_si256((const __m256i *) (b + j));
+            __m256i cmp = _mm256_cmpeq_epi32(va, vb);
+
+            for (int r = 0; r < 7; ++r) {
+                vb = _mm256_permutevar8x32_epi32(vb, rotate);
+                cmp = _mm256_or_si256(cmp, _mm256_cmpeq_epi32(va, vb));
+            }
+
+            const int mask = _mm256_movemask_ps(_mm256_castsi256_ps(cmp));
+            const __m256i permutation = _mm256_load_si256((const __m256i *) tables.avx2[mask]);
+
+            _mm256_storeu_si256((__m256i *) (out + k), _mm256_permutevar8x32_epi32(va, permutation));
+            k += (size_t) __builtin_popcount(mask);
+
+            const auto a_max = a[i + 7];
+            const auto b_max = b[j + 7];
+
+            if (a_max <= b_max) i += 8;
+            if (b_max <= a_max) j += 8;
+        }
+
+        return k + intersect_sse42(a + i, a_size - i, b + j, b_size - j, out + k);
+    }
+#else
+    size_t intersect_sse42(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out) {
+        return intersect_scalar(a, a_size, b, b_size, out);
+    }
+    size_t intersect_avx2(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out) {
+        return intersect_scalar(a, a_size, b, b_size, out);
+    }
+#endif
+
+    size_t intersect(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out) {
+        if (a_size == 0 || b_size == 0) return 0;
+        if (a_size * galloping_ratio < b_size || b_size * galloping_ratio < a_size) return intersect_galloping(a, a_size, b, b_size, out);
+
+        if (has_avx2()) return intersect_avx2(a, a_size, b, b_size, out);
+        if (has_sse42()) return intersect_sse42(a, a_size, b, b_size, out);
+
+        return intersect_scalar(a, a_size, b, b_size, out);
+    }
+
+    size_t unite_scalar(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out) {
+        size_t i = 0, j = 0, k = 0;
+
+        while (i < a_size && j < b_size) {
+            if (a[i] < b[j]) {
+                out[k++] = a[i++];
+            } else if (b[j] < a[i]) {
+                out[k++] = b[j++];
+            } else {
+                out[k++] = a[i++];
+                ++j;
+            }
+        }
+
+        while (i < a_size) out[k++] = a[i++];
+        while (j < b_size) out[k++] = b[j++];
+
+        return k;
+    }
+
+#ifdef KISSEARCH_X86
+    __attribute__((target("sse4.2")))
+    size_t unite_sse42(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out) {
+        if (a_size < 4 || b_size < 4) return unite_scalar(a, a_size, b, b_size, out);
+
+        //merge network: the next 4 ids come from the list with the smaller head, vmin is never passed by a later id
+        __m128i vmin, vmax;
+        merge(_mm_loadu_si128((const __m128i *) a), _mm_loadu_si128((const __m128i *) b), vmin, vmax);
+
+        size_t i = 4, j = 4, k = 0;
+        k += store_unique(_mm_xor_si128(_mm_shuffle_epi32(vmin, 0), _mm_set1_epi32(-1)), vmin, out);
+        __m128i previous = vmin;
+
+        while (i + 4 <= a_size && j + 4 <= b_size) {
+            __m128i next;
+
+            if (a[i] <= b[j]) {
+                next = _mm_loadu_si128((const __m128i *) (a + i));
+                i += 4;
+            } else {
+                next = _mm_loadu_si128((const __m128i *) (b + j));
+                j += 4;
+            }
+
+            merge(next, vmax, vmin, vmax);
+            k += store_unique(previous, vmin, out + k);
+            previous = vmin;
+        }
+
+        //vmax + the rest of both lists
+        uint32_t rest[4];
+        _mm_storeu_si128((__m128i *) rest, vmax);
+
+        size_t r = 0;
+        auto last = out[k - 1];
+
+        while (r < 4 || i < a_size || j < b_size) {
+            uint32_t value = UINT32_MAX;
+            int from = -1;
+
+            if (r < 4) value = rest[r], from = 0;
+            if (i < a_size && (from < 0 || a[i] < value)) value = a[i], from = 1;
+            if (j < b_size && (from < 0 || b[j] < value)) value = b[j], from = 2;
+
+            if (from == 0) ++r;
+            else if (from == 1) ++i;
+            else ++j;
+
+            if (value != last) {
+                out[k++] = value;
+                last = value;
+            }
+        }
+
+        return k;
+    }
+#else
+    size_t unite_sse42(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out) {
+        return unite_scalar(a, a_size, b, b_size, out);
+    }
+#endif
+
+    size_t unite(const uint32_t *a, const size_t &a_size, const uint32_t *b, const size_t &b_size, uint32_t *out) {
+        if (has_sse42()) return unite_sse42(a, a_size, b, b_size, out);
+        return unite_scalar(a, a_size, b, b_size, out);
+    }
+}
@@ -0,0 +1,352 @@
+#include <algorithm>
+
+#include "../include/posting.h"
+#include "../include/intersection.h"
+
+namespace kissearch {
+    posting_list::iterator::iterator(const posting_list *list) {
+        this->list = list;
+        this->block_index = 0;
+        this->size = 0;
+        this->index = 0;
+        this->positions_index = 0;
+        this->positions_cursor = 0;
+
+        load_block();
+    }
+
+    inline void posting_list::iterator::load_block() {
+        index = 0;
+        positions_index = 0;
+
+        if (block_index < list->blocks.size()) {
+            size = list->decode_block(block_index, ids, counts);
+            positions_cursor = list->blocks[block_index].positions_offset;
+        } else if (block_index == list->blocks.size()) {
+            size = (uint32_t) list->tail.size();
+            positions_cursor = list->tail_positions_offset;
+
+            for (uint32_t i = 0; i < size; ++i) {
+                ids[i] = list->tail[i].id;
+                counts[i] = list->tail[i].count;
+            }
+        } else {
+            size = 0;
+        }
+    }
+    void posting_list::iterator::next() {
+        if (++index < size) return;
+
+        ++block_index;
+        load_block();
+    }
+    void posting_list::iterator::advance(const entry_id_t &target) {
+        if (is_end() || ids[index] >= target) return;
+
+        if (ids[size - 1] < target) {
+            auto &blocks = list->blocks;
+
+            do {
+                ++block_index;
+            } while (block_index < blocks.size() && blocks[block_index].last_id < target);
+
+            load_block();
+        }
+
+        while (index < size && ids[index] < target) {
+            ++index;
+        }
+        if (index == size && size > 0) {
+            ++block_index;
+            load_block();
+        }
+    }
+
+    posting_list::block_max posting_list::iterator::shallow_advance(const entry_id_t &target) const {
+        auto &blocks = list->blocks;
+        const auto lambda = [](const block &b, const entry_id_t &id) { return b.last_id < id; };
+        auto found = std::lower_bound(blocks.begin() + (long) std::min(block_index, blocks.size()), blocks.end(), target, lambda);
+
+        if (found != blocks.end()) {
+            return { found->last_id, found->max_count, found->min_length };
+        }
+        if (!list->tail.empty() && list->tail.back().id >= target) {
+            return { list->tail.back().id, list->tail_max_count, list->tail_min_length };
+        }
+
+        return { end_id - 1, 0, 0 };
+    }
+    void posting_list::iterator::positions(std::vector<uint32_t> &out) {
+        out.clear();
+        if (!list->has_positions() || is_end()) return;
+
+        const auto *in = list->positions.data() + positions_cursor;
+
+        //the cursor only moves forward inside a block
+        for (; positions_index < index; ++positions_index) {
+            for (uint32_t i = 0; i < counts[positions_index]; ++i) {
+                read_varint(in);
+            }
+        }
+
+        positions_cursor = in - list->positions.data();
+        uint32_t position = 0;
+
+        for (uint32_t i = 0; i < counts[index]; ++i) {
+            position += read_varint(in);
+            out.push_back(position);
+        }
+    }
+
+    inline void posting_list::pack(const uint32_t *values, const uint32_t &size, const uint8_t &bits, std::vector<uint8_t> &out) {
+        uint64_t buffer = 0;
+        uint8_t filled = 0;
+
+        for (uint32_t i = 0; i < size; ++i) {
+            buffer |= (uint64_t) values[i] << filled;
+            filled += bits;
+
+            while (filled >= 8) {
+                out.push_back((uint8_t) buffer);
+                buffer >>= 8;
+                filled -= 8;
+            }
+        }
+
+        if (filled > 0) {
+            out.push_back((uint8_t) buffer);
+        }
+    }
+    inline const uint8_t *posting_list::unpack(const uint8_t *in, const uint32_t &size, const uint8_t &bits, uint32_t *values) {
+        const uint64_t mask = (bits == 32) ? 0xFFFFFFFF : ((1ULL << bits) - 1);
+        uint64_t buffer = 0;
+        uint8_t filled = 0;
+
+        for (uint32_t i = 0; i < size; ++i) {
+            while (filled < bits) {
+                buffer |= (uint64_t) *in++ << filled;
+                filled += 8;
+            }
+
+            values[i] = (uint32_t) (buffer & mask);
+            buffer >>= bits;
+            filled -= bits;
+        }
+
+        return in;
+    }
+    inline void posting_list::write_varint(uint32_t value, std::vector<uint8_t> &out) {
+        while (value >= 0x80) {
+            out.push_back((uint8_t) (value | 0x80));
+            value >>= 7;
+        }
+
+        out.push_back((uint8_t) value);
+    }
+    inline uint32_t posting_list::read_varint(const uint8_t *&in) {
+        uint32_t value = 0;
+        uint8_t shift = 0;
+
+        while (*in & 0x80) {
+            value |= (uint32_t) (*in++ & 0x7F) << shift;
+            shift += 7;
+        }
+
+        return value | ((uint32_t) *in++ << shift);
+    }
+    inline uint8_t posting_list::bits_size(const uint32_t *values, const uint32_t &size) {
+        uint32_t all = 0;
+
+        for (uint32_t i = 0; i < size; ++i) {
+            all |= values[i];
+        }
+
+        return all == 0 ? 0 : (uint8_t) (32 - __builtin_clz(all));
+    }
+
+    void posting_list::encode_block(const posting *postings, const uint32_t &size) {
+        uint32_t deltas[block_size];
+        uint32_t counts[block_size];
+        entry_id_t last_id = blocks.empty() ? 0 : blocks.back().last_id;
+
+        for (uint32_t i = 0; i < size; ++i) {
+            deltas[i] = postings[i].id - last_id;
+            counts[i] = postings[i].count - 1;
+            last_id = postings[i].id;
+        }
+
+        const auto ids_bits = bits_size(deltas, size);
+        const auto counts_bits = bits_size(counts, size);
+
+        blocks.push_back({ last_id, (uint32_t) data.size(), tail_positions_offset, tail_max_count, tail_min_length });
+        data.push_back(ids_bits);
+        data.push_back(counts_bits);
+
+        pack(deltas, size, ids_bits, data);
+        pack(counts, size, counts_bits, data);
+    }
+    uint32_t posting_list::decode_block(const size_t &block_index, entry_id_t *ids, uint32_t *counts) const {
+        const uint32_t size = (block_index + 1 < blocks.size())
+                              ? block_size
+                              : size_ - (uint32_t) tail.size() - block_size * (uint32_t) (blocks.size() - 1);
+
+        const auto *in = data.data() + blocks[block_index].offset;
+        const auto ids_bits = in[0];
+        const auto counts_bits = in[1];
+
+        in = unpack(in + 2, size, ids_bits, ids);
+
+        entry_id_t last_id = block_index == 0 ? 0 : blocks[block_index - 1].last_id;
+
+        for (uint32_t i = 0; i < size; ++i) {
+            last_id += ids[i];
+            ids[i] = last_id;
+        }
+
+        if (counts == nullptr) return size;
+        unpack(in, size, counts_bits, counts);
+
+        for (uint32_t i = 0; i < size; ++i) {
+            ++counts[i];
+        }
+
+        return size;
+    }
+
+    size_t posting_list::memory_size() const {
+        return sizeof(*this)
+               + blocks.capacity() * sizeof(block)
+               + data.capacity()
+               + tail.capacity() * sizeof(posting)
+               + positions.capacity();
+    }
+
+    void posting_list::push_back(const entry_id_t &id, const uint32_t &count, const uint32_t &length, const uint32_t *positions) {
+        //short sealed block: back to tail
+        if (tail.empty() && !blocks.empty() && size_ % block_size != 0) {
+            entry_id_t ids[block_size];
+            uint32_t counts[block_size];
+            auto size = decode_block(blocks.size() - 1, ids, counts);
+
+            tail_max_count = blocks.back().max_count;
+            tail_min_length = blocks.back().min_length;
+            tail_positions_offset = blocks.back().positions_offset;
+
+            data.resize(blocks.back().offset);
+            blocks.pop_back();
+
+            for (uint32_t i = 0; i < size; ++i) {
+                tail.push_back({ ids[i], counts[i] });
+            }
+        }
+
+        //the bounds of the norm: the scores are computed with it
+        const auto decoded_length = decode_length(encode_length(length));
+
+        tail.push_back({ id, count });
+        tail_max_count = std::max(tail_max_count, count);
+
+        if (positions != nullptr) {
+            for (uint32_t i = 0; i < count; ++i) {
+                write_varint(positions[i] - (i == 0 ? 0 : positions[i - 1]), this->positions);
+            }
+        }
+        tail_min_length = std::min(tail_min_length, decoded_length);
+
+        ++size_;
+        max_count_ = std::max(max_count_, count);
+        min_length_ = std::min(min_length_, decoded_length);
+
+        if (tail.size() == block_size) {
+            seal_tail();
+        }
+    }
+    void posting_list::clear() {
+        blocks.clear();
+        data.clear();
+        tail.clear();
+        tail_max_count = 0;
+        tail_min_length = std::numeric_limits<uint32_t>::max();
+
+        positions.clear();
+        tail_positions_offset = 0;
+
+        size_ = 0;
+        max_count_ = 0;
+        min_length_ = std::numeric_limits<uint32_t>::max();
+    }
+    void posting_list::seal_tail() {
+        encode_block(tail.data(), (uint32_t) tail.size());
+        tail.clear();
+        tail_positions_offset = (uint32_t) positions.size();
+        tail_max_count = 0;
+        tail_min_length = std::numeric_limits<uint32_t>::max();
+    }
+    void posting_list::seal() {
+        if (!tail.empty()) {
+            seal_tail();
+        }
+
+        blocks.shrink_to_fit();
+        data.shrink_to_fit();
+        tail.shrink_to_fit();
+        positions.shrink_to_fit();
+    }
+
+    std::vector<posting_list::posting> posting_list::decode() const {
+        std::vector<posting> postings;
+        postings.reserve(size_);
+
+        for (auto it = begin(); !it.is_end(); it.next()) {
+            postings.push_back({ it.id(), it.count() });
+        }
+
+        return postings;
+    }
+    std::vector<posting_list::entry_id_t> posting_list::ids() const {
+        std::vector<entry_id_t> ids(size_);
+        size_t size = 0;
+
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            size += decode_block(i, ids.data() + size, nullptr);
+        }
+        for (auto &p : tail) {
+            ids[size++] = p.id;
+        }
+
+        return ids;
+    }
+    std::vector<posting_list::entry_id_t> posting_list::intersect(const std::vector<entry_id_t> &ids) const {
+        std::vector<entry_id_t> found(std::min((size_t) size_, ids.size()) + simd_padding);
+        entry_id_t block_ids[block_size];
+        size_t size = 0, i = 0;
+
+        //the ids up to the last id of a block are intersected with the block
+        const auto intersect_range = [&](const entry_id_t *list, const size_t &list_size, const entry_id_t &last_id) {
+            auto end = (size_t) (std::upper_bound(ids.begin() + (long) i, ids.end(), last_id) - ids.begin());
+            size += kissearch::intersect(ids.data() + i, end - i, list, list_size, found.data() + size);
+            i = end;
+        };
+
+        const auto lambda = [](const block &b, const entry_id_t &id) { return b.last_id < id; };
+
+        for (auto b = blocks.begin(); i < ids.size(); ++b) {
+            //skip data: the next block with the next id
+            b = std::lower_bound(b, blocks.end(), ids[i], lambda);
+            if (b == blocks.end()) break;
+
+            auto count = decode_block((size_t) (b - blocks.begin()), block_ids, nullptr);
+            intersect_range(block_ids, count, b->last_id);
+        }
+        if (i < ids.size() && !tail.empty()) {
+            for (size_t t = 0; t < tail.size(); ++t) {
+                block_ids[t] = tail[t].id;
+            }
+
+            intersect_range(block_ids, tail.size(), tail.back().id);
+        }
+
+        found.resize(size);
+        return found;
+    }
+}
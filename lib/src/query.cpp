@@ -0,0 +1,490 @@
+#include <cctype>
+#include <charconv>
+#include <limits>
+
+#include "../include/query.h"
+
+namespace kissearch {
+    namespace {
+        struct token {
+            enum token_type {
+                word,
+                open,
+                close,
+                op_and,
+                op_or,
+                op_not,
+                op_near, //distance: NEAR/k
+                phrase,
+            };
+
+            token_type type;
+            std::string value;
+            uint32_t distance = 0;
+        };
+
+        std::vector<token> lex(const std::string &query) {
+            std::vector<token> tokens;
+            size_t i = 0;
+
+            while (i < query.size()) {
+                const auto c = query[i];
+
+                if (std::isspace((unsigned char) c)) {
+                    ++i;
+                } else if (c == '(') {
+                    tokens.push_back({ token::open, "(" });
+                    ++i;
+                } else if (c == ')') {
+                    tokens.push_back({ token::close, ")" });
+                    ++i;
+                } else if (c == '"') {
+                    auto end = query.find('"', i + 1);
+                    if (end == std::string::npos) throw query_syntax_error("query: missing \"");
+
+                    tokens.push_back({ token::phrase, query.substr(i + 1, end - i - 1) });
+                    i = end + 1;
+                } else {
+                    auto start = i;
+
+                    while (i < query.size() && !std::isspace((unsigned char) query[i]) && query[i] != '(' && query[i] != ')' && query[i] != '"') {
+                        ++i;
+                    }
+
+                    auto value = query.substr(start, i - start);
+
+                    if (value == "AND") tokens.push_back({ token::op_and, value });
+                    else if (value == "OR") tokens.push_back({ token::op_or, value });
+                    else if (value == "NOT") tokens.push_back({ token::op_not, value });
+                    else if (value.rfind("NEAR/", 0) == 0 && value.size() > 5 && value.find_first_not_of("0123456789", 5) == std::string::npos) {
+                        uint64_t distance = 0;
+                        auto parsed = std::from_chars(value.data() + 5, value.data() + value.size(), distance);
+                        if (parsed.ec != std::errc() || distance > std::numeric_limits<uint32_t>::max()) throw std::invalid_argument("query: NEAR distance too large");
+
+                        tokens.push_back({ token::op_near, value, (uint32_t) distance });
+                    } else tokens.push_back({ token::word, value });
+                }
+            }
+
+            return tokens;
+        }
+
+        //recursive descent: or := and (OR? and)*, and := near (AND near)*, near := unary (NEAR/k unary)?, unary := NOT unary | primary
+        //a NOT operand without an explicit OR excludes from the whole sequence: a NOT b OR c is (a OR c) AND NOT b
+        class parser {
+        private:
+            const std::vector<token> &tokens;
+            const is_field_t &is_field;
+            size_t position = 0;
+        private:
+            inline bool is_end() const { return position >= tokens.size(); }
+            inline const token &peek() const { return tokens[position]; }
+
+            inline static void fail(const std::string &message) {
+                throw query_syntax_error("query: " + message);
+            }
+
+            static void set_field_name(query_node &node, const std::string &field_name) {
+                if (node.type == query_node::term || node.type == query_node::phrase || node.type == query_node::proximity) {
+                    if (node.field_name.empty()) node.field_name = field_name;
+                    return;
+                }
+
+                for (auto &child : node.children) {
+                    set_field_name(child, field_name);
+                }
+            }
+            static query_node join(const query_node::node_type &type, std::vector<query_node> &children) {
+                if (children.size() == 1) return std::move(children.front());
+
+                query_node node;
+                node.type = type;
+                node.children = std::move(children);
+
+                return node;
+            }
+
+            query_node parse_primary() {
+                if (is_end()) fail("missing term");
+                auto &t = peek();
+
+                if (t.type == token::open) {
+                    ++position;
+                    auto node = parse_or();
+
+                    if (is_end() || peek().type != token::close) fail("missing )");
+                    ++position;
+
+                    return node;
+                }
+                if (t.type == token::phrase) {
+                    ++position;
+
+                    query_node node;
+                    node.type = query_node::phrase;
+                    node.value = t.value;
+
+                    return node;
+                }
+                if (t.type != token::word) fail("unexpected " + t.value);
+                ++position;
+
+                const auto colon = t.value.find(':');
+                if (colon == std::string::npos || !is_field(t.value.substr(0, colon))) {
+                    query_node node;
+                    node.value = t.value;
+
+                    return node;
+                }
+
+                auto field_name = t.value.substr(0, colon);
+                auto value = t.value.substr(colon + 1);
+
+                //field:(...)
+                if (value.empty()) {
+                    auto node = parse_primary();
+                    set_field_name(node, field_name);
+
+                    return node;
+                }
+
+                query_node node;
+                node.field_name = field_name;
+                node.value = value;
+
+                return node;
+            }
+            query_node parse_unary() {
+                if (!is_end() && peek().type == token::op_not) {
+                    ++position;
+
+                    query_node node;
+                    node.type = query_node::negation;
+                    node.children.push_back(parse_unary());
+
+                    return node;
+                }
+
+                return parse_primary();
+            }
+            query_node parse_near() {
+                auto left = parse_unary();
+                if (is_end() || peek().type != token::op_near) return left;
+
+                const auto distance = peek().distance;
+                ++position;
+                auto right = parse_unary();
+
+                if (left.type != query_node::term || right.type != query_node::term) fail("NEAR needs two words");
+                if (!left.field_name.empty() && !right.field_name.empty() && left.field_name != right.field_name) fail("NEAR needs one field");
+
+                query_node node;
+                node.type = query_node::proximity;
+                node.field_name = left.field_name.empty() ? right.field_name : left.field_name;
+                node.distance = distance;
+                node.children.push_back(std::move(left));
+                node.children.push_back(std::move(right));
+
+                return node;
+            }
+            query_node parse_and() {
+                std::vector<query_node> children;
+                children.push_back(parse_near());
+
+                while (!is_end() && peek().type == token::op_and) {
+                    ++position;
+                    children.push_back(parse_near());
+                }
+
+                return join(query_node::conjunction, children);
+            }
+            query_node parse_or() {
+                std::vector<query_node> operands;
+                std::vector<bool> is_explicit; //joined to the previous operand by OR
+                operands.push_back(parse_and());
+                is_explicit.push_back(false);
+
+                while (!is_end() && peek().type != token::close) {
+                    const bool is_or = peek().type == token::op_or;
+                    if (is_or) ++position;
+
+                    operands.push_back(parse_and());
+                    is_explicit.push_back(is_or);
+                }
+
+                std::vector<query_node> children, excluded;
+
+                for (size_t i = 0; i < operands.size(); ++i) {
+                    //the first operand is joined by the next connector
+                    const bool is_or = i == 0 ? operands.size() == 1 || is_explicit[1] : is_explicit[i];
+                    (operands[i].type == query_node::negation && !is_or ? excluded : children).push_back(std::move(operands[i]));
+                }
+
+                if (excluded.empty()) return join(query_node::disjunction, children);
+
+                query_node node;
+                node.type = query_node::conjunction;
+                if (!children.empty()) node.children.push_back(join(query_node::disjunction, children));
+                for (auto &e : excluded) node.children.push_back(std::move(e));
+
+                return node;
+            }
+        public:
+            parser(const std::vector<token> &tokens, const is_field_t &is_field) : tokens(tokens), is_field(is_field) {}
+
+            query_node parse() {
+                auto node = parse_or();
+                if (!is_end()) fail("unexpected " + peek().value);
+
+                return node;
+            }
+        };
+    }
+
+    bool is_boolean_query(const std::string &query, const is_field_t &is_field) {
+        std::vector<token> tokens;
+
+        try {
+            tokens = lex(query);
+        } catch (const query_syntax_error &) {
+            return false;
+        }
+
+        for (auto &t : tokens) {
+            if (t.type == token::op_and || t.type == token::op_or || t.type == token::op_not || t.type == token::op_near || t.type == token::phrase) return true;
+            if (t.type != token::word) continue;
+
+            const auto colon = t.value.find(':');
+            if (colon != std::string::npos && is_field(t.value.substr(0, colon))) return true;
+        }
+
+        return false;
+    }
+    query_node parse_query(const std::string &query, const is_field_t &is_field) {
+        auto tokens = lex(query);
+        if (tokens.empty()) return {};
+
+        parser p(tokens, is_field);
+        return p.parse();
+    }
+
+    posting_iterator::posting_iterator(const posting_list &postings, scorer_t scorer) : it(postings.begin()) {
+        this->size = postings.size();
+        this->scorer = std::move(scorer);
+    }
+
+    ids_iterator::ids_iterator(std::vector<entry_id_t> ids, const double &constant_score) {
+        this->ids = std::move(ids);
+        this->constant_score = constant_score;
+    }
+    void ids_iterator::advance(const entry_id_t &target) {
+        if (index >= ids.size() || ids[index] >= target) return;
+        index = std::lower_bound(ids.begin() + (long) index, ids.end(), target) - ids.begin();
+    }
+
+    all_iterator::all_iterator(const entry_id_t &size) {
+        this->size = size;
+    }
+
+    conjunction_iterator::conjunction_iterator(std::vector<query_iterator_ptr> children, std::vector<query_iterator_ptr> excluded) {
+        this->children = std::move(children);
+        this->excluded = std::move(excluded);
+
+        //the rarest child leads, the others only advance to its ids
+        std::sort(this->children.begin(), this->children.end(), [](const auto &x, const auto &y) { return x->cost() < y->cost(); });
+        align();
+    }
+    void conjunction_iterator::align() {
+        auto &lead = *children.front();
+
+        while (lead.id() != posting_list::end_id) {
+            auto target = lead.id();
+            bool is_aligned = true;
+
+            for (size_t i = 1; i < children.size(); ++i) {
+                children[i]->advance(target);
+
+                if (children[i]->id() != target) {
+                    lead.advance(children[i]->id());
+                    is_aligned = false;
+                    break;
+                }
+            }
+
+            if (!is_aligned) continue;
+
+            for (auto &e : excluded) {
+                e->advance(target);
+
+                if (e->id() == target) {
+                    is_aligned = false;
+                    break;
+                }
+            }
+
+            if (is_aligned) return;
+            lead.next();
+        }
+    }
+    void conjunction_iterator::next() {
+        children.front()->next();
+        align();
+    }
+    void conjunction_iterator::advance(const entry_id_t &target) {
+        if (id() >= target) return;
+
+        children.front()->advance(target);
+        align();
+    }
+    double conjunction_iterator::score() const {
+        double score = 0;
+
+        for (auto &child : children) {
+            score += child->score();
+        }
+
+        return score;
+    }
+
+    positional_iterator::positional_iterator(std::vector<std::unique_ptr<posting_iterator>> terms, std::vector<uint32_t> offsets, const match_type &type, const uint32_t &distance) {
+        this->terms = std::move(terms);
+        this->offsets = std::move(offsets);
+        this->type = type;
+        this->distance = distance;
+        this->positions.resize(this->terms.size());
+
+        find();
+    }
+    bool positional_iterator::is_match() {
+        for (size_t i = 0; i < terms.size(); ++i) {
+            terms[i]->positions(positions[i]);
+        }
+
+        if (type == near) {
+            //closest pair of the two sorted lists
+            auto &a = positions[0];
+            auto &b = positions[1];
+
+            for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+                if ((a[i] > b[j] ? a[i] - b[j] : b[j] - a[i]) <= distance) return true;
+                a[i] < b[j] ? ++i : ++j;
+            }
+
+            return false;
+        }
+
+        for (auto &start : positions[0]) {
+            bool is_phrase = true;
+
+            for (size_t i = 1; i < terms.size() && is_phrase; ++i) {
+                is_phrase = std::binary_search(positions[i].begin(), positions[i].end(), start + offsets[i]);
+            }
+
+            if (is_phrase) return true;
+        }
+
+        return false;
+    }
+    void positional_iterator::find() {
+        while (true) {
+            entry_id_t target = 0;
+
+            for (auto &t : terms) {
+                target = std::max(target, t->id());
+            }
+
+            if (target == posting_list::end_id) break;
+            bool is_aligned = true;
+
+            for (auto &t : terms) {
+                t->advance(target);
+                is_aligned = is_aligned && t->id() == target;
+            }
+
+            if (!is_aligned) continue;
+
+            if (is_match()) {
+                current = target;
+                return;
+            }
+
+            terms.front()->next();
+        }
+
+        current = posting_list::end_id;
+    }
+    void positional_iterator::next() {
+        terms.front()->next();
+        find();
+    }
+    void positional_iterator::advance(const entry_id_t &target) {
+        if (current >= target) return;
+
+        terms.front()->advance(target);
+        find();
+    }
+    ulong positional_iterator::cost() const {
+        ulong cost = std::numeric_limits<ulong>::max();
+
+        for (auto &t : terms) {
+            cost = std::min(cost, t->cost());
+        }
+
+        return cost;
+    }
+    double positional_iterator::score() const {
+        double score = 0;
+
+        for (auto &t : terms) {
+            score += t->score();
+        }
+
+        return score;
+    }
+
+    disjunction_iterator::disjunction_iterator(std::vector<query_iterator_ptr> children) {
+        this->children = std::move(children);
+        update();
+    }
+    void disjunction_iterator::update() {
+        current = posting_list::end_id;
+
+        for (auto &child : children) {
+            current = std::min(current, child->id());
+        }
+    }
+    void disjunction_iterator::next() {
+        for (auto &child : children) {
+            if (child->id() == current) child->next();
+        }
+
+        update();
+    }
+    void disjunction_iterator::advance(const entry_id_t &target) {
+        if (current >= target) return;
+
+        for (auto &child : children) {
+            child->advance(target);
+        }
+
+        update();
+    }
+    ulong disjunction_iterator::cost() const {
+        ulong cost = 0;
+
+        for (auto &child : children) {
+            cost += child->cost();
+        }
+
+        return cost;
+    }
+    double disjunction_iterator::score() const {
+        double score = 0;
+
+        for (auto &child : children) {
+            if (child->id() == current) score += child->score();
+        }
+
+        return score;
+    }
+}
@@ -0,0 +1,96 @@
+#include <cstring>
+#include <functional>
+
+#include "../include/stem_cache.h"
+
+namespace kissearch {
+    inline stem_cache::slot &stem_cache::find(shard &s, const std::string_view &surface, const uint32_t &hash) {
+        for (auto i = hash & (shard_slots - 1);; i = (i + 1) & (shard_slots - 1)) {
+            auto &e = s.slots[i];
+            if (e.surface_size == 0) return e;
+            if (e.hash == hash && e.surface_size == surface.size() && std::memcmp(s.bytes.data() + e.offset, surface.data(), surface.size()) == 0) return e;
+        }
+    }
+    void stem_cache::stem(const std::string_view &token, struct sb_stemmer *stemmer, std::string &out) {
+        const auto append_stem = [&]() {
+            auto stemmed = sb_stemmer_stem(stemmer, (const sb_symbol *) token.data(), (int) token.size());
+            out.append((const char *) stemmed, (size_t) sb_stemmer_length(stemmer));
+        };
+
+        if (token.size() > max_token_size) {
+            append_stem();
+            return;
+        }
+
+        //the high bits pick the shard, the low bits the slot
+        const auto full_hash = (uint64_t) std::hash<std::string_view>()(token);
+        const auto hash = (uint32_t) full_hash;
+        auto &s = shards[(full_hash >> 32) % shards_count];
+
+        s.mutex.lock();
+
+        if (!s.slots.empty()) {
+            auto &e = find(s, token, hash);
+
+            if (e.surface_size != 0) {
+                out.append(s.bytes, e.offset + e.surface_size, e.stem_size);
+                s.mutex.unlock();
+
+                return;
+            }
+        }
+
+        s.mutex.unlock();
+
+        const auto start = out.size();
+        append_stem();
+
+        const auto stem_size = out.size() - start;
+        if (stem_size > UINT8_MAX) return;
+
+        s.mutex.lock();
+
+        if (s.count >= shard_capacity) {
+            s.slots.assign(shard_slots, slot());
+            s.bytes.clear();
+            s.count = 0;
+        }
+
+        if (s.slots.empty()) s.slots.resize(shard_slots);
+        auto &e = find(s, token, hash);
+
+        //another thread can have stemmed it meanwhile
+        if (e.surface_size == 0) {
+            e.hash = hash;
+            e.offset = (uint32_t) s.bytes.size();
+            e.surface_size = (uint8_t) token.size();
+            e.stem_size = (uint8_t) stem_size;
+
+            s.bytes.append(token);
+            s.bytes.append(out, start, stem_size);
+            ++s.count;
+        }
+
+        s.mutex.unlock();
+    }
+    void stem_cache::clear() {
+        for (auto &s : shards) {
+            s.mutex.lock();
+            s.slots.clear();
+            s.bytes.clear();
+            s.count = 0;
+            s.mutex.unlock();
+        }
+    }
+    size_t stem_cache::size() {
+        size_t size = 0;
+
+        for (auto &s : shards) {
+            s.mutex.lock();
+            size += s.count;
+            s.mutex.unlock();
+        }
+
+        return size;
+    }
+}
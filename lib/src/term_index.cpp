@@ -0,0 +1,104 @@
+#include <algorithm>
+#include <numeric>
+#include <functional>
+
+#include "../include/term_index.h"
+
+namespace kissearch {
+    term_index::const_iterator term_index::sorted_terms::lower_bound(const std::string_view &term) const {
+        auto found = std::lower_bound(ids->begin(), ids->end(), term, [&](const auto &id, const auto &value) { return index->term(id) < value; });
+        return const_iterator(index, ids->data(), (size_t) (found - ids->begin()));
+    }
+
+    inline size_t term_index::hash(const std::string_view &term) {
+        return std::hash<std::string_view>()(term);
+    }
+    void term_index::grow() {
+        slots.assign(std::max<size_t>(16, slots.size() * 2), 0);
+        const auto mask = slots.size() - 1;
+
+        for (term_id_t id = 0; id < size(); ++id) {
+            auto i = hash(term(id)) & mask;
+            while (slots[i] != 0) i = (i + 1) & mask;
+
+            slots[i] = id + 1;
+        }
+    }
+    term_index::term_id_t term_index::intern(const std::string_view &value) {
+        if ((size() + 1) * 2 > slots.size()) grow();
+        const auto mask = slots.size() - 1;
+
+        for (auto i = hash(value) & mask;; i = (i + 1) & mask) {
+            if (slots[i] != 0) {
+                if (term(slots[i] - 1) == value) return slots[i] - 1;
+                continue;
+            }
+
+            const auto id = (term_id_t) size();
+            is_sorted.store(false, std::memory_order_relaxed);
+
+            arena.append(value);
+            ends.push_back((uint32_t) arena.size());
+            infos.emplace_back();
+            slots[i] = id + 1;
+
+            return id;
+        }
+    }
+    term_index::term_id_t term_index::find_id(const std::string_view &value) const {
+        if (slots.empty()) return npos;
+        const auto mask = slots.size() - 1;
+
+        for (auto i = hash(value) & mask; slots[i] != 0; i = (i + 1) & mask) {
+            if (term(slots[i] - 1) == value) return slots[i] - 1;
+        }
+
+        return npos;
+    }
+
+    void term_index::sort_terms() const {
+        const auto sorted_size = sorted.size();
+        if (sorted_size == size()) return;
+
+        const auto less = [&](const auto &x, const auto &y) { return term(x) < term(y); };
+
+        //only the new ids are sorted, then one linear merge
+        sorted.resize(size());
+        std::iota(sorted.begin() + (ptrdiff_t) sorted_size, sorted.end(), (term_id_t) sorted_size);
+        std::sort(sorted.begin() + (ptrdiff_t) sorted_size, sorted.end(), less);
+        std::inplace_merge(sorted.begin(), sorted.begin() + (ptrdiff_t) sorted_size, sorted.end(), less);
+    }
+    term_index::sorted_terms term_index::sorted_view() const {
+        //the writer holds the exclusive lock while it interns: only the searches race here
+        if (!is_sorted.load(std::memory_order_acquire)) {
+            std::lock_guard<std::mutex> lock(sort_mutex);
+
+            if (!is_sorted.load(std::memory_order_relaxed)) {
+                sort_terms();
+                is_sorted.store(true, std::memory_order_release);
+            }
+        }
+
+        return sorted_terms(*this);
+    }
+    void term_index::seal() {
+        for (auto &info : infos) {
+            info.postings.seal();
+        }
+
+        sort_terms();
+        is_sorted.store(true, std::memory_order_relaxed);
+
+        arena.shrink_to_fit();
+        ends.shrink_to_fit();
+        infos.shrink_to_fit();
+    }
+    size_t term_index::memory_size() const {
+        return sizeof(*this)
+               + arena.capacity()
+               + ends.capacity() * sizeof(uint32_t)
+               + infos.capacity() * sizeof(term_info)
+               + slots.capacity() * sizeof(term_id_t)
+               + sorted.capacity() * sizeof(term_id_t);
+    }
+}
@@ -22,6 +22,11 @@ using namespace kissearch;
                             res.status = 500;\
                             res.set_content(response.dump(), "application/json");\
                             return; }
+#define bad_request() { response["status"] = "error";\
+                            response["message"] = e.what();\
+                            res.status = 400;\
+                            res.set_content(response.dump(), "application/json");\
+                            return; }
 #define not_found_document() { response["status"] = "error";\
                             response["message"] = "Not Found";\
                             res.status = 404;\
@@ -44,16 +49,47 @@ inline document::search_options parse_search_options(const json &params) {
             options.field_names = split(value, ",");
         } else if (key == "sort_by_score") {
             options.sort_by_score = (value == "1" || value == "true");
+        } else if (key == "track_total_hits") {
+            options.track_total_hits = (value == "1" || value == "true");
         } else if (key == "page") {
             options.page = value;
         } else if (key == "page_size") {
             options.page_size = value;
+        } else if (key == "search_after") {
+            options.search_after = value;
+        } else if (key == "k") {
+            options.k = value;
+        } else if (key == "b") {
+            options.b = value;
         }
     }
 
     return options;
 }
 
+//false: a param is not a field of the document
+inline bool parse_entry(const std::vector<document::field_t> &fields, const json &params, entry &e) {
+    for (auto &param : params.items()) {
+        const auto &key = param.key();
+        const auto &value = param.value();
+
+        auto found = std::find_if(fields.begin(), fields.end(), [&](const document::field_t &c) { return c.first == key; });
+        if (found == fields.end()) return false;
+
+        field f;
+        f.name = key;
+
+        if (found->second == "number") f.val._number = std::make_shared<field::number>((std::string) value);
+        else if (found->second == "text") f.val._text = std::make_shared<field::text>((std::string) value);
+        else if (found->second == "keyword") f.val._keyword = std::make_shared<field::keyword>((std::string) value);
+        else if (found->second == "boolean") f.val._boolean = std::make_shared<field::boolean>((std::string) value);
+
+        e.fields.push_back(f);
+    }
+
+    return true;
+}
+
 int main() {
     Server server;
     collection collection;
@@ -68,7 +104,7 @@ int main() {
         auto doc = found->get();
 
         response["status"] = "ok";
-        response["entries"]["count"] = doc->entries.size();
+        response["entries"]["count"] = doc->get_entries_count();
 
         for (auto &field : doc->fields) {
             json object;
@@ -92,15 +128,36 @@ int main() {
 
         double k = 1.2;
         double b = 0.75;
+        ulong threads_count = 1;
+        std::string language = "english";
 
         if (params.find("k") != params.end()) k = params["k"];
         if (params.find("b") != params.end()) b = params["b"];
+        if (params.find("threads") != params.end()) threads_count = params["threads"];
+        if (params.find("language") != params.end()) language = params["language"];
+
+        std::shared_ptr<document> doc;
+
+        try {
+            doc = std::make_shared<document>(k, b, threads_count, language);
+        } catch (std::exception &e) {
+            exception()
+        }
 
-        auto doc = std::make_shared<document>(k, b);
         doc->name = name;
+        if (params.find("primary_key") != params.end()) doc->primary_key = params["primary_key"];
 
         for (auto &param : params.items()) {
-            doc->fields.emplace_back(param.key(), param.value());
+            const auto &key = param.key();
+            if (key == "k" || key == "b" || key == "threads" || key == "positions" || key == "primary_key" || key == "language") continue;
+
+            doc->fields.emplace_back(key, param.value());
+        }
+
+        if (params.find("positions") != params.end()) {
+            for (auto &field_name : split(params["positions"], ",")) {
+                doc->index_text_field(field_name, true);
+            }
         }
 
         collection.add(doc);
@@ -118,30 +175,10 @@ int main() {
         if (found == documents.end()) not_found_document()
         auto doc = found->get();
 
-        auto &fields = doc->fields;
-        auto &entries = doc->entries;
-
         auto params = json::parse(req.body);
         entry e;
 
-        for (auto &param : params.items()) {
-            const auto &key = param.key();
-            const auto &value = param.value();
-
-            auto found2 = std::find_if(fields.begin(), fields.end(), [&](const document::field_t &c) { return c.first == key; });
-            if (found2 == fields.end()) not_found_field()
-
-            field f;
-            f.name = key;
-
-            if (found2->second == "number") f.val._number = std::make_shared<field::number>((std::string) value);
-            else if (found2->second == "text") f.val._text = std::make_shared<field::text>((std::string) value);
-            else if (found2->second == "keyword") f.val._keyword = std::make_shared<field::keyword>((std::string) value);
-            else if (found2->second == "boolean") f.val._boolean = std::make_shared<field::boolean>((std::string) value);
-
-            e.fields.push_back(f);
-        }
-
+        if (!parse_entry(doc->fields, params, e)) not_found_field()
         doc->add(e);
 
         response["status"] = "ok";
@@ -157,10 +194,9 @@ int main() {
         if (found == documents.end()) not_found_document()
         auto doc = found->get();
 
-        auto &fields = doc->fields;
-        auto &entries = doc->entries;
-
         auto lines = split(req.body, "\n");
+        std::vector<entry> es;
+        es.reserve(lines.size());
 
         for (const auto &line : lines) {
             if (line.size() < 5) continue;
@@ -175,27 +211,12 @@ int main() {
 
             entry e;
 
-            for (auto &param : params.items()) {
-                const auto &key = param.key();
-                const auto &value = param.value();
-
-                auto found2 = std::find_if(fields.begin(), fields.end(), [&](const document::field_t &c) { return c.first == key; });
-                if (found2 == fields.end()) not_found_field()
-
-                field f;
-                f.name = key;
-
-                if (found2->second == "number") f.val._number = std::make_shared<field::number>((std::string) value);
-                else if (found2->second == "text") f.val._text = std::make_shared<field::text>((std::string) value);
-                else if (found2->second == "keyword") f.val._keyword = std::make_shared<field::keyword>((std::string) value);
-                else if (found2->second == "boolean") f.val._boolean = std::make_shared<field::boolean>((std::string) value);
-
-                e.fields.push_back(f);
-            }
-
-            doc->add(e);
+            if (!parse_entry(doc->fields, params, e)) not_found_field()
+            es.push_back(e);
         }
 
+        doc->add(es);
+
         response["status"] = "ok";
         res.status = 200;
 
@@ -227,14 +248,73 @@ int main() {
         auto options = parse_search_options(params);
         options.sort_by_score = false;
 
-        auto results = doc->search((std::string) params["q"], options, true);
+        //searched and removed under one lock: an add or a compaction can not move the hits in between
+        ulong count;
+
+        try {
+            count = doc->remove((std::string) params["q"], options);
+        } catch (std::invalid_argument &e) {
+            bad_request()
+        } catch (std::out_of_range &e) {
+            bad_request()
+        } catch (std::exception &e) {
+            exception()
+        }
+
+        response["status"] = "ok";
+        response["count"] = count;
+        res.status = 200;
+
+        res.set_content(response.dump(), "application/json");
+    });
+    server.Post("/document/(\\w*)/upsert", [&](lambda_args) {
+        auto &name = req.matches[1];
+        auto found = collection.find_document(name);
+        json response;
+
+        if (found == documents.end()) not_found_document()
+        auto doc = found->get();
+
+        auto params = json::parse(req.body);
+        entry e;
+
+        if (!parse_entry(doc->fields, params, e)) not_found_field()
+
+        try {
+            doc->upsert(e);
+        } catch (std::invalid_argument &e) {
+            bad_request()
+        } catch (std::exception &e) {
+            exception()
+        }
+
+        response["status"] = "ok";
+        res.status = 200;
+
+        res.set_content(response.dump(), "application/json");
+    });
+    server.Post("/document/(\\w*)/remove_by_key", [&](lambda_args) {
+        auto &name = req.matches[1];
+        auto found = collection.find_document(name);
+        json response;
 
-        for (const auto &result : results) {
-            doc->remove(*result.first);
+        if (found == documents.end()) not_found_document()
+        auto doc = found->get();
+        auto params = json::parse(req.body);
+        bool is_removed = false;
+
+        try {
+            //a number key is its digits
+            auto &key = params.at("key");
+            is_removed = doc->remove_by_key(key.is_string() ? key.get<std::string>() : key.dump());
+        } catch (json::exception &e) {
+            bad_request()
+        } catch (std::exception &e) {
+            exception()
         }
 
         response["status"] = "ok";
-        response["count"] = results.size();
+        response["count"] = is_removed ? 1 : 0;
         res.status = 200;
 
         res.set_content(response.dump(), "application/json");
@@ -249,23 +329,37 @@ int main() {
         auto params = json::parse(req.body);
         auto options = parse_search_options(params);
 
-        auto results = doc->search((std::string) params["q"], options);
+        document::search_result results;
+
+        try {
+            results = doc->search((std::string) params["q"], options);
+        } catch (std::invalid_argument &e) {
+            bad_request()
+        } catch (std::out_of_range &e) {
+            bad_request()
+        } catch (std::exception &e) {
+            exception()
+        }
+
         response["found"] = json::array();
 
-        for (const auto &result : results) {
+        for (auto &result : results.found) {
             json object = json::object();
             object["entry"] = json::object();
 
-            for (auto &f : result.first->fields) {
+            for (auto &f : result.e.fields) {
                 object["entry"][f.name] = f.val_s();
             }
 
-            object["score"] = result.second;
+            object["score"] = result.score;
             response["found"].push_back(object);
         }
 
         response["status"] = "ok";
-        response["count"] = results.size();
+        response["count"] = results.found.size();
+        response["total_hits"] = results.total_hits;
+        response["total_hits_exact"] = results.is_total_hits_exact;
+        if (!results.next_cursor.empty()) response["next_cursor"] = results.next_cursor;
         res.status = 200;
 
         res.set_content(response.dump(), "application/json");
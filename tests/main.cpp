@@ -1,11 +1,17 @@
 #define CATCH_CONFIG_MAIN
 #define CATCH_CONFIG_ENABLE_BENCHMARKING
 #include <catch2/catch.hpp>
+#include <atomic>
 
 #include "document.h"
 #include "collection.h"
 #include "str.h"
 #include "compression.h"
+#include "distance.h"
+#include "intersection.h"
+#include "stop_words.h"
+#include "stem_cache.h"
+#include "term_index.h"
 
 using namespace kissearch;
 
@@ -49,10 +55,198 @@ void load_example(document &document, const std::string &field_name_number, cons
     document.name = "example";
 }
 
+int reference_damerau_levenshtein_distance(const std::string &s, const std::string &v) {
+    std::vector<std::vector<int>> d(s.size() + 1, std::vector<int>(v.size() + 1));
+
+    for (size_t i = 0; i <= s.size(); ++i) d[i][0] = (int) i;
+    for (size_t j = 0; j <= v.size(); ++j) d[0][j] = (int) j;
+    for (size_t i = 1; i <= s.size(); ++i) {
+        for (size_t j = 1; j <= v.size(); ++j) {
+            int cost = s[i - 1] == v[j - 1] ? 0 : 1;
+            d[i][j] = std::min(d[i - 1][j] + 1, std::min(d[i][j - 1] + 1, d[i - 1][j - 1] + cost));
+
+            if (i > 1 && j > 1 && s[i - 1] == v[j - 2] && s[i - 2] == v[j - 1]) {
+                d[i][j] = std::min(d[i][j], d[i - 2][j - 2] + cost);
+            }
+        }
+    }
+
+    return d[s.size()][v.size()];
+}
+std::vector<std::string> random_words(const size_t &count, uint32_t seed) {
+    std::vector<std::string> words;
+    words.reserve(count);
+
+    for (size_t i = 0; i < count; ++i) {
+        seed = seed * 1103515245 + 12345;
+        std::string word;
+        auto size = 2 + (seed >> 16) % 10;
+
+        for (size_t j = 0; j < size; ++j) {
+            seed = seed * 1103515245 + 12345;
+            word += (char) ('a' + (seed >> 16) % 8);
+        }
+
+        words.push_back(word);
+    }
+
+    return words;
+}
+
 TEST_CASE("Str", "[str]") {
     REQUIRE(starts_with("test", "tes"));
     REQUIRE(ends_with("test", "est"));
 }
+TEST_CASE("Stop words", "[stop_words]") {
+    //built at compile time
+    static constexpr std::string_view words[] = { "the", "a", "of", "and", "to", "in", "is", "it", "that", "was" };
+    static constexpr stop_words_table table(words);
+
+    REQUIRE(!table.view().contains("than"));
+
+    for (auto &word : words) {
+        REQUIRE(table.view().contains(word));
+    }
+
+    auto &english = find_stop_words("english");
+
+    REQUIRE(english.contains("the"));
+    REQUIRE(english.contains("don't"));
+    REQUIRE(english.contains("very"));
+    REQUIRE(!english.contains("pagerank"));
+    REQUIRE(!english.contains("th"));
+    REQUIRE(!english.contains("le"));
+    REQUIRE(find_stop_words("porter").contains("the"));
+
+    REQUIRE(find_stop_words("french").contains("le"));
+    REQUIRE(find_stop_words("french").contains("été"));
+    REQUIRE(find_stop_words("german").contains("über"));
+    REQUIRE(find_stop_words("russian").contains("между"));
+    REQUIRE(!find_stop_words("french").contains("the"));
+    REQUIRE(find_stop_words("finnish").contains("ja"));
+    REQUIRE(find_stop_words("finnish").contains("eivät"));
+    REQUIRE(find_stop_words("hungarian").contains("és"));
+    REQUIRE(find_stop_words("hungarian").contains("őket"));
+    //the aliases of libstemmer
+    REQUIRE(find_stop_words("en").contains("the"));
+    REQUIRE(find_stop_words("fr").contains("le"));
+    REQUIRE(find_stop_words("deu").contains("über"));
+    REQUIRE(find_stop_words("fin").contains("ja"));
+    //a language of libstemmer without a list
+    REQUIRE(!find_stop_words("turkish").contains("ve"));
+
+    //the stemmer and the stop words of the document
+    document french(1.2, 0.75, 1, "french");
+    french.fields.emplace_back("title", "text");
+
+    entry e;
+    field f;
+
+    f.name = "title";
+    f.val._text = std::make_shared<field::text>("le classement des pages");
+    e.fields.push_back(f);
+    french.add(e);
+
+    document::search_options search_options;
+    search_options.field_names = { "title" };
+    search_options.text._match_type = search_options.text.strict;
+
+    REQUIRE(french.search("le", search_options).found.empty());
+    REQUIRE(french.search("classements", search_options).found.size() == 1);
+    REQUIRE(french.indexes["title"].length(0) == 2);
+
+    REQUIRE_THROWS_AS(document(1.2, 0.75, 1, "klingon"), std::invalid_argument);
+}
+TEST_CASE("Stem cache", "[stem_cache]") {
+    auto stemmer = sb_stemmer_new("english", nullptr);
+    const auto stem = [&](const std::string &word) {
+        auto stemmed = sb_stemmer_stem(stemmer, (const sb_symbol *) word.data(), (int) word.size());
+        return std::string((const char *) stemmed, (size_t) sb_stemmer_length(stemmer));
+    };
+
+    std::vector<std::string> words = {
+            "hilltop", "algorithm", "used", "find", "documents", "relevant", "particular", "keyword", "topic", "news", "search", "visualrank", "system", "finding",
+            "ranking", "images", "analysing", "comparing", "content", "rather", "searching", "image", "names", "algorithms", "engines", "links", "pages",
+    };
+    //stemmed without the cache
+    words.push_back(std::string(stem_cache::max_token_size + 1, 'a') + "ing");
+
+    stem_cache cache;
+    std::string out;
+
+    //a miss then a hit
+    for (int pass = 0; pass < 2; ++pass) {
+        for (auto &word : words) {
+            out.clear();
+            cache.stem(word, stemmer, out);
+            REQUIRE(out == stem(word));
+        }
+    }
+
+    REQUIRE(cache.size() == words.size() - 1);
+
+    //bounded: a full shard is cleared
+    for (int i = 0; i < 200000; ++i) {
+        out.clear();
+        cache.stem("word" + std::to_string(i) + "s", stemmer, out);
+    }
+
+    REQUIRE(cache.size() <= stem_cache::shards_count * stem_cache::shard_capacity);
+    cache.clear();
+    REQUIRE(cache.size() == 0);
+
+    //shared by threads with their own stemmer
+    std::atomic<ulong> mismatches(0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&]() {
+            auto thread_stemmer = sb_stemmer_new("english", nullptr);
+            std::string thread_out;
+
+            for (int i = 0; i < 1000; ++i) {
+                auto &word = words[i % words.size()];
+
+                thread_out.clear();
+                cache.stem(word, thread_stemmer, thread_out);
+
+                auto stemmed = sb_stemmer_stem(thread_stemmer, (const sb_symbol *) word.data(), (int) word.size());
+                if (thread_out != std::string((const char *) stemmed, (size_t) sb_stemmer_length(thread_stemmer))) ++mismatches;
+            }
+
+            sb_stemmer_delete(thread_stemmer);
+        });
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE(mismatches == 0);
+
+    BENCHMARK("stem, stemmer") {
+        size_t size = 0;
+
+        for (auto &word : words) {
+            size += stem(word).size();
+        }
+
+        return size;
+    };
+    BENCHMARK("stem, cache") {
+        size_t size = 0;
+
+        for (auto &word : words) {
+            out.clear();
+            cache.stem(word, stemmer, out);
+            size += out.size();
+        }
+
+        return size;
+    };
+
+    sb_stemmer_delete(stemmer);
+}
 TEST_CASE("Compression", "[compression]") {
     const std::string s = "test";
     auto compressed = compression::compress(s);
@@ -61,6 +255,407 @@ TEST_CASE("Compression", "[compression]") {
     REQUIRE(!compressed.empty());
     REQUIRE(decompressed == s);
 }
+//term -> postings of the field over the segments, the buffer is flushed
+std::map<std::string, std::vector<posting_list::posting>> get_postings(document &document, const std::string &field_name) {
+    std::map<std::string, std::vector<posting_list::posting>> postings;
+    document.flush();
+
+    for (auto &segment : document.get_segments()) {
+        auto term_index = segment->find(field_name);
+        if (term_index == nullptr) continue;
+
+        for (auto i : *term_index) {
+            auto decoded = i.second.postings.decode();
+            auto &term_postings = postings[std::string(i.first)];
+
+            term_postings.insert(term_postings.end(), decoded.begin(), decoded.end());
+        }
+    }
+
+    return postings;
+}
+
+TEST_CASE("Posting list", "[posting_list]") {
+    const uint32_t size = 1000000;
+
+    posting_list postings;
+    std::vector<posting_list::posting> expected;
+
+    for (uint32_t i = 0; i < size; ++i) {
+        posting_list::posting posting { i * 3 + (i % 3), 1 + (i % 5 == 0 ? i % 13 : 0) };
+
+        expected.push_back(posting);
+        postings.push_back(posting.id, posting.count, 10);
+    }
+
+    postings.seal();
+
+    REQUIRE(postings.size() == size);
+    REQUIRE(postings.decode().size() == size);
+
+    auto it = postings.begin();
+    for (auto &posting : expected) {
+        REQUIRE(it.id() == posting.id);
+        REQUIRE(it.count() == posting.count);
+        it.next();
+    }
+    REQUIRE(it.is_end());
+
+    it = postings.begin();
+    it.advance(expected[5000].id);
+    REQUIRE(it.id() == expected[5000].id);
+    it.advance(expected[5000].id + 1);
+    REQUIRE(it.id() == expected[5001].id);
+    it.advance(expected.back().id + 1);
+    REQUIRE(it.is_end());
+
+    postings.push_back(expected.back().id + 1, 2, 10);
+    REQUIRE(postings.size() == size + 1);
+    REQUIRE(postings.decode().back().id == expected.back().id + 1);
+
+    //packed blocks: about a byte per posting (4 bytes of id and 4 of count unpacked)
+    REQUIRE((double) postings.memory_size() / postings.size() < 1.5);
+
+    //lengths are quantized to a byte, exact while short and monotonic
+    for (uint32_t length = 0, previous = 0; length < 1000000; length += 1 + length / 64) {
+        const auto decoded = posting_list::decode_length(posting_list::encode_length(length));
+
+        REQUIRE(decoded <= length);
+        REQUIRE(decoded >= previous);
+        REQUIRE(decoded >= std::min(length, 524287U) - std::min(length, 524287U) / 16);
+        if (length < 32) REQUIRE(decoded == length);
+
+        previous = decoded;
+    }
+
+    //positions survive the blocks, the sealed tail and advance
+    posting_list positional;
+    std::vector<std::vector<uint32_t>> expected_positions;
+
+    for (uint32_t i = 0; i < 300; ++i) {
+        std::vector<uint32_t> positions;
+
+        for (uint32_t j = 0; j <= i % 4; ++j) {
+            positions.push_back(i % 7 + j * (200 + i));
+        }
+
+        expected_positions.push_back(positions);
+        positional.push_back(i * 2, (uint32_t) positions.size(), 1000, positions.data());
+        if (i == 200) positional.seal();
+    }
+
+    positional.seal();
+    REQUIRE(positional.has_positions());
+    REQUIRE_FALSE(postings.has_positions());
+
+    std::vector<uint32_t> positions;
+    auto positional_it = positional.begin();
+
+    for (auto &expected_position : expected_positions) {
+        positional_it.positions(positions);
+        REQUIRE(positions == expected_position);
+        positional_it.next();
+    }
+
+    positional_it = positional.begin();
+    positional_it.advance(2 * 250);
+    positional_it.positions(positions);
+    REQUIRE(positions == expected_positions[250]);
+
+    BENCHMARK("posting list push_back") {
+        posting_list list;
+
+        for (auto &posting : expected) {
+            list.push_back(posting.id, posting.count, 10);
+        }
+
+        return list.size();
+    };
+    BENCHMARK("posting list next") {
+        uint64_t sum = 0;
+
+        for (auto i = postings.begin(); !i.is_end(); i.next()) {
+            sum += i.count();
+        }
+
+        return sum;
+    };
+    BENCHMARK("posting list advance") {
+        uint64_t sum = 0;
+
+        for (auto i = postings.begin(); !i.is_end(); i.advance(i.id() + 1000)) {
+            sum += i.count();
+        }
+
+        return sum;
+    };
+}
+TEST_CASE("Term index", "[term_index]") {
+    term_index index;
+    std::vector<std::string> terms;
+
+    //enough to grow the table a few times
+    for (int i = 0; i < 10000; ++i) {
+        terms.push_back("term" + std::to_string(i * 7919 % 10000));
+    }
+
+    for (size_t i = 0; i < terms.size(); ++i) {
+        REQUIRE(index.intern(terms[i]) == i);
+        index.info((term_index::term_id_t) i).postings.push_back((posting_list::entry_id_t) i, 1, 1);
+    }
+
+    REQUIRE(index.size() == terms.size());
+    REQUIRE(index.intern(terms[42]) == 42);
+    REQUIRE(index.size() == terms.size());
+    REQUIRE(index.find_id("term") == term_index::npos);
+    REQUIRE(index.find("term10000") == nullptr);
+
+    //the ids index the terms and their postings
+    for (size_t i = 0; i < terms.size(); ++i) {
+        auto id = index.find_id(terms[i]);
+
+        REQUIRE(id == i);
+        REQUIRE(index.term(id) == terms[i]);
+        REQUIRE(index.find(terms[i])->postings.ids() == std::vector<posting_list::entry_id_t>{ (posting_list::entry_id_t) i });
+    }
+
+    const auto check_sorted = [&]() {
+        auto sorted = terms;
+        std::sort(sorted.begin(), sorted.end());
+
+        auto view = index.sorted_view();
+        size_t i = 0;
+
+        for (auto it = view.begin(); it != view.end(); ++it) {
+            REQUIRE(it->first == sorted[i++]);
+        }
+
+        REQUIRE(i == sorted.size());
+        REQUIRE(view.lower_bound("term5")->first == "term5");
+        REQUIRE(view.lower_bound("term9998a")->first == "term9999");
+        REQUIRE(view.lower_bound("u") == view.end());
+    };
+
+    //the new ids merged by the view, then by seal
+    check_sorted();
+
+    for (int i = 0; i < 1000; ++i) {
+        terms.push_back("terms" + std::to_string(i * 7919 % 1000));
+        index.intern(terms.back());
+    }
+
+    check_sorted();
+    index.seal();
+    check_sorted();
+
+    REQUIRE(index.find(terms.back()) != nullptr);
+    REQUIRE(index.memory_size() > terms.size() * sizeof(term_info));
+    REQUIRE(index.memory_size() < terms.size() * (sizeof(term_info) + 32));
+}
+TEST_CASE("Intersection", "[intersection]") {
+    uint32_t seed = 11;
+    const auto random = [&]() { return seed = seed * 1103515245 + 12345, seed >> 8; };
+    //sorted unique ids, about one of step
+    const auto random_ids = [&](const size_t &size, const uint32_t &step) {
+        std::vector<uint32_t> ids;
+        uint32_t id = 0;
+
+        for (size_t i = 0; i < size; ++i) {
+            id += 1 + random() % step;
+            ids.push_back(id);
+        }
+
+        return ids;
+    };
+
+    typedef size_t (*kernel_t)(const uint32_t *, const size_t &, const uint32_t *, const size_t &, uint32_t *);
+    std::vector<std::pair<std::string, kernel_t>> intersections = { { "scalar", intersect_scalar }, { "galloping", intersect_galloping }, { "dispatch", intersect } };
+    std::vector<std::pair<std::string, kernel_t>> unions = { { "scalar", unite_scalar }, { "dispatch", unite } };
+
+    if (has_sse42()) {
+        intersections.emplace_back("sse4.2", intersect_sse42);
+        unions.emplace_back("sse4.2", unite_sse42);
+    }
+    if (has_avx2()) intersections.emplace_back("avx2", intersect_avx2);
+
+    for (size_t a_size : { 0, 1, 3, 4, 7, 8, 9, 17, 100, 1000 }) {
+        for (size_t b_size : { 0, 2, 5, 8, 33, 1000, 5000 }) {
+            for (uint32_t step : { 2, 10 }) {
+                auto a = random_ids(a_size, step);
+                auto b = random_ids(b_size, step);
+
+                std::vector<uint32_t> expected;
+                std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+
+                for (auto &kernel : intersections) {
+                    std::vector<uint32_t> out(std::min(a_size, b_size) + simd_padding);
+                    out.resize(kernel.second(a.data(), a.size(), b.data(), b.size(), out.data()));
+
+                    INFO(kernel.first << " " << a_size << " " << b_size);
+                    REQUIRE(out == expected);
+                }
+
+                expected.clear();
+                std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(expected));
+
+                for (auto &kernel : unions) {
+                    std::vector<uint32_t> out(a_size + b_size + simd_padding);
+                    out.resize(kernel.second(a.data(), a.size(), b.data(), b.size(), out.data()));
+
+                    INFO(kernel.first << " " << a_size << " " << b_size);
+                    REQUIRE(out == expected);
+                }
+            }
+        }
+    }
+
+    //posting lists: only the blocks with candidates are decoded
+    posting_list postings;
+    auto ids = random_ids(100000, 4);
+
+    for (auto &id : ids) {
+        postings.push_back(id, 1, 10);
+    }
+
+    REQUIRE(postings.ids() == ids);
+
+    for (size_t size : { 1, 100, 10000, 200000 }) {
+        auto candidates = random_ids(size, 4);
+
+        REQUIRE(postings.intersect(candidates) == intersect(ids, candidates));
+    }
+
+    //skewed lengths: long list of 1M ids, short lists of 1M / ratio
+    const auto long_ids = random_ids(1000000, 8);
+
+    for (size_t ratio : { 1, 10, 100, 1000 }) {
+        auto short_ids = random_ids(1000000 / ratio, 8 * (uint32_t) ratio);
+        std::vector<uint32_t> out(short_ids.size() + simd_padding);
+        const auto suffix = " 1:" + std::to_string(ratio);
+
+        for (auto &kernel : intersections) {
+            BENCHMARK("intersect " + kernel.first + suffix) {
+                return kernel.second(short_ids.data(), short_ids.size(), long_ids.data(), long_ids.size(), out.data());
+            };
+        }
+    }
+    for (size_t ratio : { 1, 100 }) {
+        auto short_ids = random_ids(1000000 / ratio, 8 * (uint32_t) ratio);
+        std::vector<uint32_t> out(short_ids.size() + long_ids.size() + simd_padding);
+        const auto suffix = " 1:" + std::to_string(ratio);
+
+        for (auto &kernel : unions) {
+            BENCHMARK("unite " + kernel.first + suffix) {
+                return kernel.second(short_ids.data(), short_ids.size(), long_ids.data(), long_ids.size(), out.data());
+            };
+        }
+    }
+}
+TEST_CASE("Damerau Levenshtein automaton", "[damerau_levenshtein_automaton]") {
+    std::map<std::string, int> terms;
+
+    for (auto &word : random_words(30000, 7)) {
+        terms[word];
+    }
+
+    for (auto &pattern : random_words(20, 11)) {
+        for (uint32_t max_distance : { 0, 1, 2 }) {
+            std::vector<std::string> expected;
+            std::vector<std::string> found;
+
+            for (auto &term : terms) {
+                if (reference_damerau_levenshtein_distance(term.first, pattern) <= (int) max_distance) {
+                    expected.push_back(term.first);
+                }
+            }
+
+            damerau_levenshtein_automaton automaton(pattern, max_distance);
+            automaton.walk(terms, [&](const auto &it, const uint32_t &distance) {
+                REQUIRE((int) distance == reference_damerau_levenshtein_distance(it->first, pattern));
+                found.push_back(it->first);
+            });
+
+            REQUIRE(found == expected);
+        }
+    }
+
+    const std::string pattern = "abcdeffe";
+
+    BENCHMARK("fuzzy terms, scan") {
+        ulong count = 0;
+
+        for (auto &term : terms) {
+            if (reference_damerau_levenshtein_distance(term.first, pattern) <= 2) ++count;
+        }
+
+        return count;
+    };
+    BENCHMARK("fuzzy terms, automaton") {
+        ulong count = 0;
+
+        damerau_levenshtein_automaton automaton(pattern, 2);
+        automaton.walk(terms, [&](const auto &, const uint32_t &) { ++count; });
+
+        return count;
+    };
+}
+TEST_CASE("Damerau Levenshtein distance", "[damerau_levenshtein_distance]") {
+    auto words = random_words(2000, 3);
+    words.emplace_back(100, 'a');
+    words.emplace_back(std::string(70, 'b') + "ab");
+
+    for (size_t i = 0; i + 1 < words.size(); i += 2) {
+        auto &s = words[i];
+
+        for (auto &v : { words[i + 1], s, s.substr(1), s + "x", std::string(s.rbegin(), s.rend()) }) {
+            auto expected = (uint32_t) reference_damerau_levenshtein_distance(s, v);
+
+            for (uint32_t max_distance : { 0, 1, 2, 3, 100 }) {
+                REQUIRE(compute_damerau_levenshtein_distance(s, v, max_distance) == std::min(expected, max_distance + 1));
+            }
+        }
+    }
+
+    REQUIRE(compute_damerau_levenshtein_distance("algorithm", "algoritmh", 2) == 1);
+    REQUIRE(compute_damerau_levenshtein_distance("algorithm", "logarithm", 2) == 3);
+    REQUIRE(compute_damerau_levenshtein_distance("ca", "ac", 2) == 1);
+
+    //the vocabulary of the example corpus + random terms
+    document document;
+    load_example(document, "id", "title", "url", 1);
+    document.index_text_field("title");
+
+    std::vector<std::string> vocabulary = random_words(20000, 5);
+
+    for (auto &i : get_postings(document, "title")) {
+        vocabulary.push_back(i.first);
+    }
+
+    const std::vector<std::string> queries = { "algoritm", "serch", "engnie", "pagerank", "abcdefg" };
+
+    BENCHMARK("distance, full matrix") {
+        ulong count = 0;
+
+        for (auto &query : queries) {
+            for (auto &term : vocabulary) {
+                if (reference_damerau_levenshtein_distance(term, query) <= 2) ++count;
+            }
+        }
+
+        return count;
+    };
+    BENCHMARK("distance, bit-parallel bounded") {
+        ulong count = 0;
+
+        for (auto &query : queries) {
+            for (auto &term : vocabulary) {
+                if (compute_damerau_levenshtein_distance(term, query, 2) <= 2) ++count;
+            }
+        }
+
+        return count;
+    };
+}
 TEST_CASE("Document", "[document]") {
     const std::string file_name = "index.db";
     const std::string field_name_number = "id";
@@ -76,7 +671,7 @@ TEST_CASE("Document", "[document]") {
     auto &document = *collection.documents.front();
 
     BENCHMARK("load from memory") {
-        document.entries.clear();
+        document.clear();
         return load_example(document, field_name_number, field_name_text, field_name_keyword, 1000); //7000
     };
 
@@ -84,7 +679,7 @@ TEST_CASE("Document", "[document]") {
         return document.save(file_name);
     };
     BENCHMARK("load from db") {
-        document.entries.clear();
+        document.clear();
         return document.load(file_name);
     };*/
 
@@ -92,6 +687,27 @@ TEST_CASE("Document", "[document]") {
         return document.index_text_field(field_name_text);
     };
 
+    size_t postings_memory_size = 0;
+    size_t postings_size = 0;
+    size_t terms_memory_size = 0;
+    size_t terms_size = 0;
+
+    for (auto &segment : document.get_segments()) {
+        auto &term_index = *segment->find(field_name_text);
+
+        for (auto i : term_index) {
+            postings_memory_size += i.second.postings.memory_size();
+            postings_size += i.second.postings.size();
+        }
+
+        terms_memory_size += term_index.memory_size();
+        terms_size += term_index.size();
+    }
+
+    REQUIRE((double) postings_memory_size / postings_size < 1);
+    //the terms besides their term_info: a std::map of std::string took 72 bytes per term
+    REQUIRE((double) (terms_memory_size - terms_size * sizeof(term_info)) / terms_size < 40);
+
     REQUIRE(document.entries[0].fields.size() == 3);
 
     document::search_options search_options_number;
@@ -103,31 +719,82 @@ TEST_CASE("Document", "[document]") {
     search_options_keyword.field_names = { field_name_keyword };
 
     BENCHMARK("number search") {
-        auto results = document.search(number_query, search_options_number);
+        auto results = document.search(number_query, search_options_number).found;
         REQUIRE(results.size() == 1);
     };
     BENCHMARK("text search") {
-        auto results = document.search(text_query, search_options_text);
+        auto results = document.search(text_query, search_options_text).found;
         REQUIRE(results.size() == 10); //10 - page size
     };
     BENCHMARK("keyword search") {
-        auto results = document.search(keyword_query, search_options_keyword);
+        auto results = document.search(keyword_query, search_options_keyword).found;
         REQUIRE(results.size() == 10); //10 - page size
     };
 }
-TEST_CASE("Document ranking", "[document_ranking]") {
-    std::vector<std::string> texts = {
-            { "hello good man" },
-            { "quite windy windy london" },
-            { "weather windy today" },
-    };
+TEST_CASE("Document index scaling", "[.][document_index_scaling]") {
+    const std::string field_name_number = "id";
     const std::string field_name_text = "title";
+    const std::string field_name_keyword = "url";
 
-    collection collection;
-    collection.documents.push_back(std::make_shared<document>());
-    auto &document = *collection.documents.front();
+    document document;
 
-    for (auto &text : texts) {
+    for (int size : { 100000, 1000000 }) {
+        document.clear();
+        load_example(document, field_name_number, field_name_text, field_name_keyword, size / 7);
+
+        BENCHMARK("index " + std::to_string(document.entries.size())) {
+            return document.index_text_field(field_name_text);
+        };
+    }
+}
+TEST_CASE("Document tokenizer", "[document_tokenizer]") {
+    const std::string field_name_text = "title";
+
+    document document;
+    document.fields.emplace_back(field_name_text, "text");
+    document.index_text_field(field_name_text, true);
+
+    entry e;
+    field f;
+
+    f.name = field_name_text;
+    f.val._text = std::make_shared<field::text>("Search-Engine,RANK  (PageRank) don't\tcafé 42");
+
+    e.fields.push_back(f);
+    document.add(e);
+
+    //split on any non word byte, lowercased, the stop word "don't" is dropped, utf-8 bytes are word bytes
+    auto postings = get_postings(document, field_name_text);
+
+    REQUIRE(postings.size() == 6);
+    REQUIRE(postings.count("search") == 1);
+    REQUIRE(postings.count("engin") == 1);
+    REQUIRE(postings.count("rank") == 1);
+    REQUIRE(postings.count("pagerank") == 1);
+    REQUIRE(postings.count("42") == 1);
+    REQUIRE(document.indexes[field_name_text].length(0) == 6);
+
+    document::search_options search_options;
+    search_options.field_names = { field_name_text };
+    search_options.text._match_type = search_options.text.strict;
+
+    REQUIRE(document.search("ENGINE", search_options).found.size() == 1);
+    REQUIRE(document.search("café", search_options).found.size() == 1);
+    //the separators do not take positions
+    REQUIRE(document.search("\"engine rank\"", search_options, true).found.size() == 1);
+    REQUIRE(document.search("\"search rank\"", search_options, true).found.empty());
+}
+TEST_CASE("Document incremental index", "[document_incremental_index]") {
+    const std::string field_name_text = "title";
+
+    document document;
+    document.fields.emplace_back(field_name_text, "text");
+
+    document::search_options search_options_text;
+    search_options_text.field_names = { field_name_text };
+    search_options_text.text._match_type = search_options_text.text.strict;
+
+    const auto add = [&](const std::string &text) {
         entry e;
         field f;
 
@@ -135,10 +802,1102 @@ TEST_CASE("Document ranking", "[document_ranking]") {
         f.val._text = std::make_shared<field::text>(text);
 
         e.fields.push_back(f);
-        document.entries.push_back(e);
-    }
+        document.add(e);
+    };
 
-    document.index_text_field(field_name_text);
+    add("hello good man");
+    REQUIRE(document.search("hello", search_options_text).found.size() == 1);
+
+    add("quite windy windy london");
+    add("weather windy today");
+    REQUIRE(document.search("windy", search_options_text).found.size() == 2);
+    REQUIRE(get_postings(document, field_name_text)["windi"].size() == 2);
+
+    auto results = document.search("windy", search_options_text).found;
+
+    document.index();
+    document.index();
+
+    auto postings = get_postings(document, field_name_text)["windi"];
+
+    REQUIRE(postings.size() == 2);
+    REQUIRE(postings[0].id == 1);
+    REQUIRE(postings[0].count == 2);
+
+    auto reindexed = document.search("windy", search_options_text).found;
+
+    REQUIRE(reindexed.size() == results.size());
+    REQUIRE(reindexed[0].score == Approx(results[0].score));
+
+    //one norm per entry, a remove moves them with their entries
+    auto &index = document.indexes[field_name_text];
+
+    REQUIRE(index.norms == std::vector<uint8_t>{ 3, 4, 3 });
+
+    document.remove(document.entries[0]);
+
+    REQUIRE(index.norms == std::vector<uint8_t>{ 4, 3 });
+    REQUIRE(index.avgdl() == Approx(3.5));
+
+    auto removed = document.search("windy", search_options_text).found;
+    document.index();
+    auto removed_reindexed = document.search("windy", search_options_text).found;
+
+    REQUIRE(removed.size() == 2);
+    REQUIRE(removed[0].score == Approx(removed_reindexed[0].score));
+    REQUIRE(removed[1].score == Approx(removed_reindexed[1].score));
+}
+TEST_CASE("Document field indexes", "[document_field_indexes]") {
+    const std::string field_name_title = "title";
+    const std::string field_name_body = "body";
+
+    document document;
+    document.fields.emplace_back(field_name_title, "text");
+    document.fields.emplace_back(field_name_body, "text");
+
+    const auto add = [&](const std::string &title, const std::string &body) {
+        entry e;
+        field f_t, f_b;
+
+        f_t.name = field_name_title;
+        f_t.val._text = std::make_shared<field::text>(title);
+
+        f_b.name = field_name_body;
+        f_b.val._text = std::make_shared<field::text>(body);
+
+        e.fields.push_back(f_t);
+        e.fields.push_back(f_b);
+        document.add(e);
+    };
+
+    add("pagerank", "link analysis algorithm");
+    add("trustrank", "spam detection with link analysis");
+
+    document::search_options search_options;
+    search_options.text._match_type = search_options.text.strict;
+
+    search_options.field_names = { field_name_title };
+    REQUIRE(document.search("link", search_options).found.empty());
+    REQUIRE(document.search("pagerank", search_options).found.size() == 1);
+
+    search_options.field_names = { field_name_body };
+    REQUIRE(document.search("link", search_options).found.size() == 2);
+    REQUIRE(document.search("pagerank", search_options).found.empty());
+
+    REQUIRE(document.indexes[field_name_title].avgdl() == Approx(1));
+    REQUIRE(document.indexes[field_name_body].avgdl() == Approx(3.5));
+
+    //exhaustive path: scores of both fields summed by id, the scratch is reset between queries
+    search_options.sort_by_score = false;
+    search_options.field_names = { field_name_title };
+    const auto title_score = document.search("pagerank", search_options).found[0].score;
+    search_options.field_names = { field_name_body };
+    const auto body_score = document.search("pagerank link", search_options).found[0].score;
+
+    search_options.field_names = { field_name_title, field_name_body };
+    for (int i = 0; i < 2; ++i) {
+        auto results = document.search("pagerank link", search_options).found;
+
+        REQUIRE(results.size() == 2);
+        REQUIRE(results[0].id == 0);
+        REQUIRE(results[0].score == Approx(title_score + body_score));
+    }
+    search_options.sort_by_score = true;
+
+    document.remove(document.entries[0]);
+    add("hilltop", "link relevance");
+
+    auto postings = get_postings(document, field_name_body)["link"];
+
+    REQUIRE(postings.size() == 2);
+    REQUIRE(postings[0].id == 0);
+    REQUIRE(postings[1].id == 1);
+    REQUIRE(get_postings(document, field_name_title).count("pagerank") == 0);
+    REQUIRE(document.indexes[field_name_body].avgdl() == Approx(3));
+}
+TEST_CASE("Document parallel index", "[document_parallel_index]") {
+    const std::string field_name_number = "id";
+    const std::string field_name_text = "title";
+    const std::string field_name_keyword = "url";
+
+    document serial;
+    document parallel(1.2, 0.75, 4);
+
+    load_example(serial, field_name_number, field_name_text, field_name_keyword, 100);
+    load_example(parallel, field_name_number, field_name_text, field_name_keyword, 100);
+
+    serial.index_text_field(field_name_text);
+    parallel.index_text_field(field_name_text);
+
+    auto serial_index = get_postings(serial, field_name_text);
+    auto parallel_index = get_postings(parallel, field_name_text);
+
+    REQUIRE(serial_index.size() == parallel_index.size());
+
+    for (auto &i : serial_index) {
+        auto &postings = parallel_index[i.first];
+        auto &serial_postings = i.second;
+        REQUIRE(postings.size() == serial_postings.size());
+
+        for (size_t j = 0; j < postings.size(); ++j) {
+            REQUIRE(postings[j].id == serial_postings[j].id);
+            REQUIRE(postings[j].count == serial_postings[j].count);
+        }
+    }
+}
+TEST_CASE("Document segments", "[document_segments]") {
+    const std::string field_name_text = "title";
+    const auto words = random_words(500, 11);
+
+    document segmented;
+    document reference;
+    segmented.fields.emplace_back(field_name_text, "text");
+    reference.fields.emplace_back(field_name_text, "text");
+
+    uint32_t seed = 11;
+    const auto random = [&]() { return seed = seed * 1103515245 + 12345, (seed >> 16) & 0x7FFF; };
+
+    std::vector<entry> es;
+    const auto size = document::buffer_size * (document::merge_factor + 1) + 100;
+
+    for (size_t i = 0; i < size; ++i) {
+        entry e;
+        field f;
+
+        f.name = field_name_text;
+        f.val._text = std::make_shared<field::text>(words[random() % words.size()] + " " + words[random() % 50] + " " + words[random() % words.size()]);
+
+        e.fields.push_back(f);
+        es.push_back(e);
+    }
+
+    document::search_options search_options;
+    search_options.field_names = { field_name_text };
+    search_options.text._match_type = search_options.text.strict;
+
+    //searches go on while the entries are added, flushed and merged
+    std::atomic<bool> is_added(false);
+    std::thread searcher([&]() {
+        while (!is_added) {
+            segmented.search(words[0] + " " + words[1], search_options);
+        }
+    });
+
+    for (auto &e : es) {
+        segmented.add(e);
+    }
+
+    is_added = true;
+    searcher.join();
+
+    reference.add(es);
+    reference.index();
+
+    //the first merge_factor flushed buffers become one segment in the background
+    for (int i = 0; i < 500 && segmented.get_segments().front()->size != document::buffer_size * document::merge_factor; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    auto segments = segmented.get_segments();
+
+    REQUIRE(segments.front()->size == document::buffer_size * document::merge_factor);
+    REQUIRE(segments.size() == 2);
+
+    const auto same_postings = [&]() {
+        auto postings = get_postings(segmented, field_name_text);
+        auto expected = get_postings(reference, field_name_text);
+
+        REQUIRE(postings.size() == expected.size());
+
+        for (auto &i : expected) {
+            auto &term_postings = postings[i.first];
+            REQUIRE(term_postings.size() == i.second.size());
+
+            for (size_t j = 0; j < term_postings.size(); ++j) {
+                REQUIRE(term_postings[j].id == i.second[j].id);
+                REQUIRE(term_postings[j].count == i.second[j].count);
+            }
+        }
+    };
+
+    same_postings();
+
+    const auto same = [&](const std::string &query, const bool &is_all) {
+        auto found = segmented.search(query, search_options, is_all).found;
+        auto expected = reference.search(query, search_options, is_all).found;
+
+        REQUIRE(found.size() == expected.size());
+
+        for (size_t i = 0; i < found.size(); ++i) {
+            REQUIRE(found[i].id == expected[i].id);
+            REQUIRE(found[i].score == Approx(expected[i].score));
+        }
+    };
+
+    for (size_t i = 0; i < 10; ++i) {
+        same(words[i] + " " + words[i + 50], false);
+        same(words[i] + " " + words[i + 50], true);
+        same(words[i] + " AND " + words[i + 1], true);
+    }
+
+    //the ids of every segment move on compaction
+    segmented.remove(segmented.entries[5]);
+    reference.remove(reference.entries[5]);
+
+    same_postings();
+    same(words[0] + " " + words[1], true);
+
+    segmented.compact();
+    reference.compact();
+
+    same_postings();
+    same(words[0] + " " + words[1], true);
+}
+TEST_CASE("Document remove", "[document_remove]") {
+    const std::vector<std::string> words = { "pagerank", "trustrank", "hubs", "authorities", "relevance", "spam" };
+    const std::string field_name_body = "body";
+    const std::string field_name_tag = "tag";
+
+    document document;
+    class document reference;
+
+    for (auto d : { &document, &reference }) {
+        d->fields.emplace_back(field_name_body, "text");
+        d->fields.emplace_back(field_name_tag, "keyword");
+    }
+
+    const auto make_entry = [&](const size_t &i) {
+        entry e;
+        field f_b, f_k;
+
+        f_b.name = field_name_body;
+        f_b.val._text = std::make_shared<field::text>(words[i % words.size()] + " link " + words[(i * 7) % words.size()] + (i % 3 == 0 ? " link" : ""));
+
+        f_k.name = field_name_tag;
+        f_k.val._keyword = std::make_shared<field::keyword>(i % 2 == 0 ? "even" : "odd");
+
+        e.fields.push_back(f_b);
+        e.fields.push_back(f_k);
+        return e;
+    };
+
+    const size_t size = 12;
+    const std::vector<document::entry_id_t> removed = { 1, 4 };
+
+    for (size_t i = 0; i < size; ++i) {
+        document.add(make_entry(i));
+        if (std::find(removed.begin(), removed.end(), i) == removed.end()) reference.add(make_entry(i));
+    }
+
+    document::search_options search_options;
+    search_options.text._match_type = search_options.text.strict;
+    search_options.field_names = { field_name_body };
+
+    //the ids of reference: the removed ids are skipped
+    const auto reference_id = [&](const document::entry_id_t &id) {
+        return id - (document::entry_id_t) std::count_if(removed.begin(), removed.end(), [&](auto &r) { return r < id; });
+    };
+    const auto same = [&](const std::string &query, const bool &is_all, const bool &is_compacted) {
+        auto found = document.search(query, search_options, is_all).found;
+        auto expected = reference.search(query, search_options, is_all).found;
+
+        REQUIRE(found.size() == expected.size());
+
+        for (size_t i = 0; i < found.size(); ++i) {
+            auto id = found[i].id;
+
+            REQUIRE(document.is_live(id));
+            REQUIRE(found[i].e == document.entries[id]);
+            REQUIRE((is_compacted ? id : reference_id(id)) == expected[i].id);
+            //the removed entries count in the document frequencies until the compaction
+            if (is_compacted) REQUIRE(found[i].score == Approx(expected[i].score));
+        }
+    };
+
+    document.remove(removed);
+    //removed twice: counted once
+    document.remove(std::vector<document::entry_id_t>{ 1 });
+
+    REQUIRE(document.entries.size() == size);
+    REQUIRE(document.get_entries_count() == size - removed.size());
+    REQUIRE(!document.is_live(1));
+    REQUIRE(document.is_live(2));
+
+    for (auto &query : { "link", "pagerank hubs", "link AND NOT spam", "tag:odd", "NOT tag:even" }) {
+        same(query, false, false);
+        same(query, true, false);
+    }
+    search_options.sort_by_score = false;
+    same("link", false, false);
+    search_options.sort_by_score = true;
+
+    document.compact();
+
+    REQUIRE(document.entries.size() == size - removed.size());
+    REQUIRE(document.get_entries_count() == size - removed.size());
+    REQUIRE(document.indexes[field_name_body].avgdl() == Approx(reference.indexes[field_name_body].avgdl()));
+    REQUIRE(get_postings(document, field_name_body)["link"].size() == size - removed.size());
+
+    for (auto &query : { "link", "pagerank hubs", "link AND NOT spam", "tag:odd" }) {
+        same(query, false, true);
+        same(query, true, true);
+    }
+
+    //a quarter of the entries removed: compacted by the remove
+    document.remove(std::vector<document::entry_id_t>{ 0, 1 });
+    REQUIRE(document.entries.size() == size - removed.size());
+
+    document.remove(std::vector<document::entry_id_t>{ 2 });
+    REQUIRE(document.entries.size() == size - removed.size() - 3);
+    REQUIRE(document.get_entries_count() == size - removed.size() - 3);
+
+    //the hits keep their entries when the entries move
+    auto found = document.search("link", search_options).found;
+    auto copied = found.front().e;
+
+    for (size_t i = 0; i < 100; ++i) {
+        document.add(make_entry(i));
+    }
+
+    REQUIRE(found.front().e == copied);
+    REQUIRE(found.front().e.fields[0].val._text->value.find("link") != std::string::npos);
+
+    //searched and removed under one lock
+    search_options.field_names = { field_name_tag };
+    const auto odd = document.search("odd", search_options, true).found.size();
+
+    REQUIRE(odd > 0);
+    REQUIRE(document.remove("odd", search_options) == odd);
+    REQUIRE(document.search("odd", search_options, true).found.empty());
+
+    //a text field declared after the adds: the entries before are counted, the compaction takes them back
+    class document late;
+    late.fields.emplace_back(field_name_tag, "keyword");
+
+    for (size_t i = 0; i < size; ++i) {
+        late.add(make_entry(i));
+    }
+
+    late.fields.emplace_back(field_name_body, "text");
+    late.add(make_entry(size));
+    REQUIRE(late.indexes[field_name_body].entries_count == size + 1);
+
+    late.remove(std::vector<document::entry_id_t>{ 0, 1, 2, 3 });
+    REQUIRE(late.entries.size() == size - 3);
+    REQUIRE(late.indexes[field_name_body].entries_count == size - 3);
+
+    search_options.field_names = { field_name_body };
+    auto late_found = late.search("link", search_options, true).found;
+
+    REQUIRE(late_found.size() == size - 3);
+    REQUIRE(late_found.front().score > 0.01);
+
+    late.add(make_entry(size + 1));
+    REQUIRE(late.search("link", search_options, true).found.size() == size - 2);
+}
+TEST_CASE("Document primary key", "[document_primary_key]") {
+    const std::string field_name_id = "id";
+    const std::string field_name_body = "body";
+
+    document document;
+    document.fields.emplace_back(field_name_id, "number");
+    document.fields.emplace_back(field_name_body, "text");
+    document.primary_key = field_name_id;
+
+    const auto make_entry = [&](const ulong &id, const std::string &body) {
+        entry e;
+        field f_i, f_b;
+
+        f_i.name = field_name_id;
+        f_i.val._number = std::make_shared<field::number>(id);
+
+        f_b.name = field_name_body;
+        f_b.val._text = std::make_shared<field::text>(body);
+
+        e.fields.push_back(f_i);
+        e.fields.push_back(f_b);
+        return e;
+    };
+
+    const std::vector<std::string> bodies = { "pagerank link", "trustrank spam", "hubs authorities", "okapi relevance", "hilltop expert", "cheirank matrix" };
+
+    for (auto &body : bodies) {
+        document.add(make_entry(document.compute_next_number_value(field_name_id), body));
+    }
+
+    document::search_options search_options;
+    search_options.text._match_type = search_options.text.strict;
+    search_options.field_names = { field_name_body };
+
+    const auto keys = [&](const std::string &query) {
+        std::vector<ulong> keys;
+
+        for (auto &result : document.search(query, search_options, true).found) {
+            keys.push_back(result.e.find_field(field_name_id)._number->value);
+        }
+
+        std::sort(keys.begin(), keys.end());
+        return keys;
+    };
+
+    REQUIRE(document.compute_next_number_value(field_name_id) == bodies.size() + 1);
+    auto found = document.find_by_key("2");
+    REQUIRE(found->find_field(field_name_body)._text->value == "trustrank spam");
+    REQUIRE(!document.find_by_key("7").has_value());
+
+    //only the postings of the replaced entry change
+    document.upsert(make_entry(2, "trustrank link"));
+    //a copy: kept by the change
+    REQUIRE(found->find_field(field_name_body)._text->value == "trustrank spam");
+
+    REQUIRE(document.get_entries_count() == bodies.size());
+    REQUIRE(keys("spam").empty());
+    REQUIRE(keys("link") == std::vector<ulong>{ 1, 2 });
+    REQUIRE(document.find_by_key("2")->find_field(field_name_body)._text->value == "trustrank link");
+
+    //an add of an existing key replaces its entry too
+    document.add(make_entry(3, "hubs link"));
+    REQUIRE(keys("link") == std::vector<ulong>{ 1, 2, 3 });
+    REQUIRE(keys("authorities").empty());
+
+    REQUIRE(document.remove_by_key("1"));
+    REQUIRE(!document.remove_by_key("1"));
+    REQUIRE(keys("link") == std::vector<ulong>{ 2, 3 });
+
+    //the compaction keeps the keys of the moved entries
+    document.compact();
+
+    REQUIRE(document.entries.size() == bodies.size() - 1);
+    REQUIRE(document.find_by_key("3")->find_field(field_name_body)._text->value == "hubs link");
+    REQUIRE(document.find_by_key("6")->find_field(field_name_body)._text->value == "cheirank matrix");
+    REQUIRE(keys("link") == std::vector<ulong>{ 2, 3 });
+
+    //a removed key is not reused
+    document.remove_by_key("6");
+    REQUIRE(document.compute_next_number_value(field_name_id) == bodies.size() + 1);
+
+    REQUIRE_THROWS_AS(document.upsert(entry()), std::invalid_argument);
+}
+TEST_CASE("Document concurrent search", "[document_concurrent_search]") {
+    const std::string field_name_number = "id";
+    const std::string field_name_text = "title";
+    const std::string field_name_keyword = "url";
+
+    document document;
+    load_example(document, field_name_number, field_name_text, field_name_keyword, 50);
+    document.index_text_field(field_name_text);
+
+    document::search_options search_options;
+    search_options.field_names = { field_name_text };
+
+    const std::vector<std::string> queries = { "ranking algorithms", "searching engines link", "pages AND rank", "relevance NOT google", "matrices networks" };
+    std::vector<std::vector<document::result_t>> expected;
+
+    for (auto &query : queries) {
+        expected.push_back(document.search(query, search_options).found);
+    }
+
+    //every search stems with the stemmer of its thread
+    std::atomic<ulong> mismatches(0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t]() {
+            for (size_t i = 0; i < 200; ++i) {
+                const auto q = (i + t) % queries.size();
+                auto found = document.search(queries[q], search_options).found;
+
+                if (found.size() != expected[q].size() || !std::equal(found.begin(), found.end(), expected[q].begin(), [](auto &x, auto &y) { return x.id == y.id && x.score == y.score; })) {
+                    ++mismatches;
+                }
+            }
+        });
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE(mismatches == 0);
+    REQUIRE(!expected.front().empty());
+
+    //fuzzy searches over the new terms of the buffer: the first one sorts them, the others wait for it
+    for (auto &text : { "rankers of pagerankers", "rankings linkers", "searchers" }) {
+        entry e;
+        field f;
+
+        f.name = field_name_text;
+        f.val._text = std::make_shared<field::text>(text);
+
+        e.fields.push_back(f);
+        document.add(e);
+    }
+
+    const std::vector<std::string> fuzzy_queries = { "rankers", "linkers searchers", "pagerankers" };
+    std::vector<std::vector<std::vector<document::result_t>>> found(4);
+    threads.clear();
+
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t]() {
+            for (auto &query : fuzzy_queries) {
+                found[t].push_back(document.search(query, search_options).found);
+            }
+        });
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (size_t q = 0; q < fuzzy_queries.size(); ++q) {
+        auto sequential = document.search(fuzzy_queries[q], search_options).found;
+        REQUIRE(!sequential.empty());
+
+        for (auto &thread_found : found) {
+            REQUIRE(thread_found[q].size() == sequential.size());
+
+            for (size_t i = 0; i < sequential.size(); ++i) {
+                REQUIRE(thread_found[q][i].id == sequential[i].id);
+            }
+        }
+    }
+}
+TEST_CASE("Document concurrent add", "[document_concurrent_add]") {
+    const std::string field_name_text = "title";
+
+    document document;
+    document.fields.emplace_back(field_name_text, "text");
+
+    document::search_options search_options;
+    search_options.field_names = { field_name_text };
+
+    //an add is analyzed before the lock: a search sees a batch whole or not at all
+    const size_t batches_count = 50;
+    const size_t batch_size = 20;
+    std::atomic<bool> is_adding(true);
+    std::atomic<ulong> partial_batches(0);
+    std::atomic<ulong> decreases(0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < 3; ++t) {
+        threads.emplace_back([&]() {
+            size_t last = 0;
+
+            while (is_adding) {
+                auto found = document.search("zebras crossing", search_options, true).found.size();
+                if (found % batch_size != 0) ++partial_batches;
+                if (found < last) ++decreases;
+
+                last = found;
+            }
+        });
+    }
+
+    for (size_t i = 0; i < batches_count; ++i) {
+        std::vector<entry> es(batch_size);
+
+        for (auto &e : es) {
+            field f { field_name_text };
+            f.val._text = std::make_shared<field::text>("a zebra crossed the road " + std::to_string(i));
+            e.fields.push_back(f);
+        }
+
+        document.add(es);
+    }
+
+    is_adding = false;
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    REQUIRE(partial_batches == 0);
+    REQUIRE(decreases == 0);
+    REQUIRE(document.search("zebras crossing", search_options, true).found.size() == batches_count * batch_size);
+}
+TEST_CASE("Document top k", "[document_top_k]") {
+    const std::vector<std::string> words = {
+            "algorithm", "search", "engine", "rank", "page", "link", "analysis", "spam", "matrix", "network",
+            "query", "relevance", "document", "frequency", "image", "content", "google", "result", "web", "topic",
+    };
+    const std::string field_name_title = "title";
+    const std::string field_name_body = "body";
+
+    document document;
+    document.fields.emplace_back(field_name_title, "text");
+    document.fields.emplace_back(field_name_body, "text");
+
+    uint32_t seed = 42;
+    const auto random = [&]() { return seed = seed * 1103515245 + 12345, (seed >> 16) & 0x7FFF; };
+    const auto random_text = [&](int size) {
+        std::string text;
+
+        for (int i = 0; i < size; ++i) {
+            text += words[random() % (i % 3 == 0 ? words.size() : 6)] + " ";
+        }
+
+        return text;
+    };
+
+    for (int i = 0; i < 3000; ++i) {
+        entry e;
+        field f_t, f_b;
+
+        f_t.name = field_name_title;
+        f_t.val._text = std::make_shared<field::text>(random_text(2 + (int) (random() % 6)));
+
+        f_b.name = field_name_body;
+        f_b.val._text = std::make_shared<field::text>(random_text(5 + (int) (random() % 40)));
+
+        e.fields.push_back(f_t);
+        e.fields.push_back(f_b);
+        document.add(e);
+    }
+
+    document::search_options search_options;
+    search_options.field_names = { field_name_title, field_name_body };
+
+    for (auto &query : { "algorithm", "rank page", "spam networks google", "searching queries" }) {
+        for (ulong page : { 1, 3 }) {
+            search_options.page = page;
+
+            auto top_k = document.search(query, search_options);
+            auto all = document.search(query, search_options, true).found;
+            auto &results = top_k.found;
+
+            REQUIRE(results.size() == 10);
+            REQUIRE(top_k.total_hits >= page * search_options.page_size);
+            REQUIRE(top_k.total_hits <= all.size());
+
+            search_options.track_total_hits = true;
+            auto tracked = document.search(query, search_options);
+            search_options.track_total_hits = false;
+
+            REQUIRE(tracked.total_hits == all.size());
+            REQUIRE(tracked.is_total_hits_exact);
+
+            for (ulong i = 0; i < results.size(); ++i) {
+                auto &expected = all[(page - 1) * search_options.page_size + i];
+
+                REQUIRE(results[i].id == expected.id);
+                REQUIRE(results[i].score == Approx(expected.score));
+                REQUIRE(tracked.found[i].id == expected.id);
+            }
+        }
+    }
+
+    //a page past the hits
+    search_options.page = 1000;
+    auto past = document.search("algorithm", search_options);
+
+    REQUIRE(past.found.empty());
+    REQUIRE(past.is_total_hits_exact);
+
+    //search_after: the pages crawled by cursor are the ranked hits, wand and exhaustive
+    search_options.page = 1;
+    search_options.page_size = 25;
+
+    for (auto track_total_hits : { false, true }) {
+        search_options.track_total_hits = track_total_hits;
+        search_options.search_after.clear();
+
+        auto all = document.search("rank spam", search_options, true).found;
+        std::vector<document::result_t> crawled;
+
+        while (true) {
+            auto page = document.search("rank spam", search_options);
+            //a cursor only with hits after it: no empty last page
+            REQUIRE(!page.found.empty());
+            crawled.insert(crawled.end(), page.found.begin(), page.found.end());
+
+            if (page.next_cursor.empty()) break;
+            search_options.search_after = page.next_cursor;
+        }
+
+        REQUIRE(crawled.size() == all.size());
+
+        for (size_t i = 0; i < all.size(); ++i) {
+            REQUIRE(crawled[i].id == all[i].id);
+        }
+
+        //a page that ends at the last hit
+        search_options.search_after.clear();
+        search_options.page_size = all.size();
+
+        auto last = document.search("rank spam", search_options);
+        REQUIRE(last.found.size() == all.size());
+        REQUIRE(last.next_cursor.empty());
+
+        search_options.page_size = all.size() - 1;
+        REQUIRE(!document.search("rank spam", search_options).next_cursor.empty());
+
+        search_options.page_size = 25;
+    }
+
+    search_options.search_after = "page 2";
+    REQUIRE_THROWS_AS(document.search("rank", search_options), std::invalid_argument);
+
+    //no page 0 and no empty page, wand and exhaustive
+    search_options.search_after.clear();
+
+    for (auto track_total_hits : { false, true }) {
+        search_options.track_total_hits = track_total_hits;
+
+        search_options.page = 0;
+        REQUIRE_THROWS_AS(document.search("rank", search_options), std::invalid_argument);
+
+        search_options.page = 1;
+        search_options.page_size = 0;
+        REQUIRE_THROWS_AS(document.search("rank", search_options), std::invalid_argument);
+
+        search_options.page_size = 25;
+    }
+}
+TEST_CASE("Document boolean query", "[document_boolean_query]") {
+    const auto is_field = [](const std::string &field_name) { return field_name == "title"; };
+
+    REQUIRE_FALSE(is_boolean_query("page rank", is_field));
+    REQUIRE_FALSE(is_boolean_query("(page rank)", is_field));
+    REQUIRE_FALSE(is_boolean_query("https://en.wikipedia.org/wiki/PageRank", is_field));
+    REQUIRE(is_boolean_query("page AND rank", is_field));
+    REQUIRE(is_boolean_query("title:rank", is_field));
+
+    //a NOT of the implicit sequence excludes from all of it: (link OR (rank AND spam) OR title:(page web)) AND NOT spam
+    auto root = parse_query("link NOT spam rank AND spam OR title:(page web)", is_field);
+
+    REQUIRE(root.type == query_node::conjunction);
+    REQUIRE(root.children.size() == 2);
+    REQUIRE(root.children[0].type == query_node::disjunction);
+    REQUIRE(root.children[0].children.size() == 3);
+    REQUIRE(root.children[0].children[1].type == query_node::conjunction);
+    REQUIRE(root.children[0].children[2].children[1].field_name == "title");
+    REQUIRE(root.children[1].type == query_node::negation);
+    REQUIRE(root.children[1].children[0].value == "spam");
+    //an explicit OR keeps the negation an operand
+    REQUIRE(parse_query("link OR NOT spam", is_field).type == query_node::disjunction);
+    REQUIRE(parse_query("NOT spam", is_field).type == query_node::negation);
+    REQUIRE(parse_query("http://x.org AND page", is_field).children[0].value == "http://x.org");
+
+    REQUIRE_THROWS_AS(parse_query("(page rank", is_field), std::invalid_argument);
+    REQUIRE_THROWS_AS(parse_query("page AND", is_field), std::invalid_argument);
+    REQUIRE_THROWS_AS(parse_query("page)", is_field), query_syntax_error);
+    REQUIRE_THROWS_AS(parse_query("NOT", is_field), query_syntax_error);
+    REQUIRE(!is_boolean_query("5\" screen", is_field));
+
+    const std::string field_name_title = "title";
+    const std::string field_name_body = "body";
+    const std::string field_name_tag = "tag";
+
+    document document;
+    document.fields.emplace_back(field_name_title, "text");
+    document.fields.emplace_back(field_name_body, "text");
+    document.fields.emplace_back(field_name_tag, "keyword");
+
+    const auto add = [&](const std::string &title, const std::string &body, const std::string &tag) {
+        entry e;
+        field f_t, f_b, f_k;
+
+        f_t.name = field_name_title;
+        f_t.val._text = std::make_shared<field::text>(title);
+
+        f_b.name = field_name_body;
+        f_b.val._text = std::make_shared<field::text>(body);
+
+        f_k.name = field_name_tag;
+        f_k.val._keyword = std::make_shared<field::keyword>(tag);
+
+        e.fields.push_back(f_t);
+        e.fields.push_back(f_b);
+        e.fields.push_back(f_k);
+        document.add(e);
+    };
+
+    add("pagerank", "link analysis algorithm", "ranking");
+    add("trustrank", "spam detection with link analysis", "spam");
+    add("hits", "hubs and authorities link algorithm", "ranking");
+    add("bm25", "probabilistic relevance of terms", "retrieval");
+
+    document::search_options search_options;
+    search_options.text._match_type = search_options.text.strict;
+    search_options.field_names = { field_name_title, field_name_body };
+
+    const auto ids = [&](const std::string &query) {
+        std::vector<document::entry_id_t> ids;
+
+        for (auto &result : document.search(query, search_options, true).found) {
+            ids.push_back(result.id);
+        }
+
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    };
+
+    REQUIRE(ids("link AND algorithm") == std::vector<document::entry_id_t>{ 0, 2 });
+    REQUIRE(ids("link AND NOT spam") == std::vector<document::entry_id_t>{ 0, 2 });
+    REQUIRE(ids("spam OR relevance") == std::vector<document::entry_id_t>{ 1, 3 });
+    REQUIRE(ids("(spam OR hubs) AND link") == std::vector<document::entry_id_t>{ 1, 2 });
+    REQUIRE(ids("NOT link") == std::vector<document::entry_id_t>{ 3 });
+    REQUIRE(ids("link NOT spam") == std::vector<document::entry_id_t>{ 0, 2 });
+    REQUIRE(ids("NOT spam link") == std::vector<document::entry_id_t>{ 0, 2 });
+    REQUIRE(ids("link relevance NOT spam NOT hubs") == std::vector<document::entry_id_t>{ 0, 3 });
+    REQUIRE(ids("link OR NOT spam") == std::vector<document::entry_id_t>{ 0, 1, 2, 3 });
+    REQUIRE(ids("title:link").empty());
+    REQUIRE(ids("title:(pagerank hits)") == std::vector<document::entry_id_t>{ 0, 2 });
+    REQUIRE(ids("tag:ranking AND NOT algorithm").empty());
+    REQUIRE(ids("tag:ranking AND hubs") == std::vector<document::entry_id_t>{ 2 });
+    //not a field: the colon splits the words as in the indexed text
+    REQUIRE(ids("unknown:link") == ids("unknown link"));
+    //stop words are dropped from the conjunction
+    REQUIRE(ids("link AND the AND algorithm") == std::vector<document::entry_id_t>{ 0, 2 });
+    //a lone " and a dangling operator are searched as plain words
+    REQUIRE(ids("link 5\" algorithm") == ids("link 5 algorithm"));
+    REQUIRE(ids("link 5\" algorithm") == std::vector<document::entry_id_t>{ 0, 1, 2 });
+    REQUIRE(ids("NOT").empty());
+    REQUIRE(ids("spam AND") == std::vector<document::entry_id_t>{ 1 });
+
+    //a value that is not a number matches no number field
+    class document numbers;
+    numbers.fields.emplace_back("n", "number");
+
+    for (ulong n : { 1, 2 }) {
+        entry e;
+        field f;
+
+        f.name = "n";
+        f.val._number = std::make_shared<field::number>(n);
+        e.fields.push_back(f);
+        numbers.add(e);
+    }
+
+    document::search_options search_options_number;
+    search_options_number.field_names = { "n" };
+
+    REQUIRE(numbers.search("n:2", search_options_number, true).found.size() == 1);
+    REQUIRE(numbers.search("n:abc", search_options_number, true).found.empty());
+    REQUIRE(numbers.search("n:2x OR n:1", search_options_number, true).found.size() == 1);
+    REQUIRE(numbers.search("abc", search_options_number, true).found.empty());
+
+    //the scores of a disjunction are the scores of the plain query
+    auto plain = document.search("spam relevance", search_options, true).found;
+    auto boolean = document.search("spam OR relevance", search_options, true).found;
+
+    REQUIRE(plain.size() == boolean.size());
+
+    for (size_t i = 0; i < plain.size(); ++i) {
+        REQUIRE(plain[i].id == boolean[i].id);
+        REQUIRE(plain[i].score == Approx(boolean[i].score));
+    }
+
+    //a conjunction matches the intersection of the single word hits
+    ::document corpus;
+    corpus.fields.emplace_back(field_name_body, "text");
+
+    std::vector<std::string> words;
+    for (auto &word : random_words(200, 7)) {
+        if (word.size() >= 5 && std::find(words.begin(), words.end(), word) == words.end()) words.push_back(word);
+    }
+
+    uint32_t seed = 7;
+    const auto random = [&]() { return seed = seed * 1103515245 + 12345, (seed >> 16) & 0x7FFF; };
+
+    for (int i = 0; i < 5000; ++i) {
+        std::string text;
+
+        for (int j = 0; j < 12; ++j) {
+            text += words[random() % (j % 2 == 0 ? words.size() : 5)] + " ";
+        }
+
+        entry e;
+        field f;
+
+        f.name = field_name_body;
+        f.val._text = std::make_shared<field::text>(text);
+
+        e.fields.push_back(f);
+        corpus.add(e);
+    }
+
+    search_options.field_names = { field_name_body };
+
+    const auto corpus_ids = [&](const std::string &query) {
+        std::vector<document::entry_id_t> ids;
+
+        for (auto &result : corpus.search(query, search_options, true).found) {
+            ids.push_back(result.id);
+        }
+
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    };
+
+    for (size_t i = 5; i < 15; ++i) {
+        auto first = corpus_ids(words[0]);
+        auto second = corpus_ids(words[i]);
+        auto third = corpus_ids(words[1]);
+
+        std::vector<document::entry_id_t> both, expected;
+        std::set_intersection(first.begin(), first.end(), second.begin(), second.end(), std::back_inserter(both));
+        std::set_difference(both.begin(), both.end(), third.begin(), third.end(), std::back_inserter(expected));
+
+        REQUIRE(corpus_ids(words[0] + " AND " + words[i] + " AND NOT " + words[1]) == expected);
+    }
+
+    BENCHMARK("conjunction of a rare and a common word") {
+        return corpus.search(words[20] + " AND " + words[0], search_options, true).found.size();
+    };
+    BENCHMARK("conjunction of common words") {
+        return corpus.search(words[0] + " AND " + words[2] + " AND NOT " + words[1], search_options, true).found.size();
+    };
+}
+TEST_CASE("Document phrase query", "[document_phrase_query]") {
+    const auto is_field = [](const std::string &field_name) { return field_name == "title"; };
+
+    REQUIRE(is_boolean_query("\"page rank\"", is_field));
+    REQUIRE(is_boolean_query("page NEAR/2 rank", is_field));
+    REQUIRE(parse_query("title:\"page rank\"", is_field).field_name == "title");
+
+    auto near = parse_query("link AND page NEAR/2 rank", is_field);
+
+    REQUIRE(near.type == query_node::conjunction);
+    REQUIRE(near.children[1].type == query_node::proximity);
+    REQUIRE(near.children[1].distance == 2);
+
+    REQUIRE_THROWS_AS(parse_query("\"page rank", is_field), std::invalid_argument);
+    REQUIRE_THROWS_AS(parse_query("(page OR link) NEAR/2 rank", is_field), std::invalid_argument);
+
+    const std::string field_name_title = "title";
+    const std::string field_name_body = "body";
+
+    document document;
+    document.fields.emplace_back(field_name_title, "text");
+    document.fields.emplace_back(field_name_body, "text");
+
+    for (auto &body : {
+            "the quick brown fox jumps over the lazy dog",
+            "brown quick fox",
+            "quick and brown fox",
+            "fox hunting in the forest near quick rivers",
+    }) {
+        entry e;
+        field f_t, f_b;
+
+        f_t.name = field_name_title;
+        f_t.val._text = std::make_shared<field::text>("quick brown");
+
+        f_b.name = field_name_body;
+        f_b.val._text = std::make_shared<field::text>(body);
+
+        e.fields.push_back(f_t);
+        e.fields.push_back(f_b);
+        document.add(e);
+    }
+
+    document.index_text_field(field_name_body, true);
+
+    document::search_options search_options;
+    search_options.text._match_type = search_options.text.strict;
+    search_options.field_names = { field_name_body };
+
+    const auto ids = [&](const std::string &query) {
+        std::vector<document::entry_id_t> ids;
+
+        for (auto &result : document.search(query, search_options, true).found) {
+            ids.push_back(result.id);
+        }
+
+        std::sort(ids.begin(), ids.end());
+        return ids;
+    };
+
+    REQUIRE(ids("\"quick brown\"") == std::vector<document::entry_id_t>{ 0 });
+    REQUIRE(ids("\"brown fox\"") == std::vector<document::entry_id_t>{ 0, 2 });
+    //a stop word keeps its position
+    REQUIRE(ids("\"quick and brown\"") == std::vector<document::entry_id_t>{ 2 });
+    REQUIRE(ids("\"fox jumps over the lazy dog\"") == std::vector<document::entry_id_t>{ 0 });
+    REQUIRE(ids("\"lazy fox\"").empty());
+    REQUIRE(ids("\"forest\"") == std::vector<document::entry_id_t>{ 3 });
+    REQUIRE(ids("quick NEAR/1 fox") == std::vector<document::entry_id_t>{ 1 });
+    REQUIRE(ids("fox NEAR/3 quick") == std::vector<document::entry_id_t>{ 0, 1, 2 });
+    //a side of NEAR is one term: not a stop word, not a word split in several terms
+    REQUIRE_THROWS_AS(document.search("the NEAR/2 fox", search_options, true), std::invalid_argument);
+    REQUIRE_THROWS_AS(document.search("fox NEAR/2 the", search_options, true), std::invalid_argument);
+    REQUIRE_THROWS_AS(document.search("quick-brown NEAR/2 fox", search_options, true), std::invalid_argument);
+    REQUIRE(ids("\"brown fox\" AND NOT jumps") == std::vector<document::entry_id_t>{ 2 });
+    REQUIRE(ids("\"brown fox\" OR rivers") == std::vector<document::entry_id_t>{ 0, 2, 3 });
+
+    //positions are rebuilt with the remaining ids
+    document.remove(document.entries[0]);
+    REQUIRE(ids("\"brown fox\"") == std::vector<document::entry_id_t>{ 1 });
+
+    //title has no positions: the words of a phrase are a conjunction
+    REQUIRE(ids("title:\"brown quick\"") == std::vector<document::entry_id_t>{ 0, 1, 2 });
+    REQUIRE(ids("title:(quick NEAR/1 fox)").empty());
+    REQUIRE(ids("title:\"quick brown\"") == ids("title:quick AND title:brown"));
+    //the words are analyzed like the positional ones: punctuation and stop words dropped
+    REQUIRE(ids("title:\"the quick, brown!\"") == std::vector<document::entry_id_t>{ 0, 1, 2 });
+
+    //positional and not: each field by its own
+    REQUIRE(ids("\"quick brown\"").empty());
+    search_options.field_names = { field_name_title, field_name_body };
+    REQUIRE(ids("\"quick brown\"") == std::vector<document::entry_id_t>{ 0, 1, 2 });
+    REQUIRE(ids("\"fox quick\"").empty());
+    REQUIRE(ids("\"brown fox\"") == std::vector<document::entry_id_t>{ 1 });
+}
+TEST_CASE("Document ranking", "[document_ranking]") {
+    std::vector<std::string> texts = {
+            { "hello good man" },
+            { "quite windy windy london" },
+            { "weather windy today" },
+    };
+    const std::string field_name_text = "title";
+
+    collection collection;
+    collection.documents.push_back(std::make_shared<document>());
+    auto &document = *collection.documents.front();
+
+    for (auto &text : texts) {
+        entry e;
+        field f;
+
+        f.name = field_name_text;
+        f.val._text = std::make_shared<field::text>(text);
+
+        e.fields.push_back(f);
+        document.entries.push_back(e);
+    }
+
+    document.index_text_field(field_name_text);
+
+    //bm25 at query time: k and b of the query without a reindex
+    const auto idf = std::log1p((3.0 - 2 + 0.5) / (2 + 0.5));
+    const auto avgdl = 10.0 / 3;
+    const auto bm25 = [&](const double &tf, const double &length, const double &k, const double &b) {
+        return idf * tf * (k + 1) / (tf + k * (1 - b + b * length / avgdl));
+    };
+
+    document::search_options search_options;
+    search_options.field_names = { field_name_text };
+    search_options.text._match_type = search_options.text.strict;
+
+    for (auto is_all : { false, true }) {
+        auto found = document.search("windy", search_options, is_all).found;
+
+        REQUIRE(found.size() == 2);
+        REQUIRE(found[0].id == 1);
+        REQUIRE(found[0].score == Approx(bm25(2, 4, 1.2, 0.75)));
+        REQUIRE(found[1].score == Approx(bm25(1, 3, 1.2, 0.75)));
+    }
+
+    search_options.k = 2;
+    search_options.b = 0;
+
+    for (auto is_all : { false, true }) {
+        auto found = document.search("windy", search_options, is_all).found;
+
+        REQUIRE(found.size() == 2);
+        REQUIRE(found[0].score == Approx(bm25(2, 4, 2, 0)));
+        REQUIRE(found[1].score == Approx(bm25(1, 3, 2, 0)));
+    }
 
    /* for (auto &i : document.in) {
         for (auto &e : i.second.es) {